@@ -1,16 +1,38 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <libusb.h>
 
+#include "library.h"
+#include "stream.h"
+
 #define VID 0x1d50
 #define PID 0x615b
 #define ENDPOINT 1
 
-#define NUM_TRANSFERS 4
-#define TRANSFER_SIZE 256*1024
-#define TIMEOUT_MS 100
+#define DEFAULT_NUM_TRANSFERS 4
+#define DEFAULT_TRANSFER_SIZE 256*1024
+#define DEFAULT_TIMEOUT_MS 100
+#define MAX_PACKET_SIZE 512
+#define RING_SIZE 64
+// Memory for packets in a rolling window limited only by time.
+#define DEFAULT_WINDOW_BYTES 0x8000000
+// Memory for packets held back before a trigger fires.
+#define TRIGGER_HELD_BYTES 0x4000000
+// Time kept before and after each packet firing a trigger, by default.
+#define DEFAULT_TRIGGER_MS 100
 
 #define TO_STDERR(fmt, ...) fprintf(stderr, fmt "\n", __VA_ARGS__)
 
@@ -33,25 +55,216 @@
 
 static libusb_context* usb_context;
 static libusb_device_handle* usb_device;
-static struct libusb_transfer* usb_transfers[NUM_TRANSFERS];
-static uint8_t usb_buffers[NUM_TRANSFERS][TRANSFER_SIZE];
+static struct libusb_transfer** usb_transfers;
+static uint8_t* usb_buffers;
+// Number of transfers currently in flight.
+static int num_transfers = DEFAULT_NUM_TRANSFERS;
+// Limit for adding transfers in flight, or zero if not adaptive.
+static int max_transfers = 0;
+static int transfer_size = DEFAULT_TRANSFER_SIZE;
+static unsigned int timeout_ms = DEFAULT_TIMEOUT_MS;
+static unsigned long completions = 0;
+static unsigned long completions_full = 0;
 static int interrupted = 0;
 static bool capture_started = false;
 static bool capture_stopped = false;
 static int transfers_empty = 0;
 static int transfers_stopped = 0;
+static struct decoder *decoder = NULL;
+static bool decode = false;
+static unsigned int decoder_flags = 0;
+static char *output_filename = NULL;
+static uint64_t window_bytes = 0;
+static uint64_t window_ns = 0;
+static struct trigger trigger = {
+	.pre_ns = DEFAULT_TRIGGER_MS * 1000000ULL,
+	.post_ns = DEFAULT_TRIGGER_MS * 1000000ULL,
+};
+static bool triggered = false;
+static bool verbose = false;
+static bool timestamps = true;
+// Offset from CLOCK_MONOTONIC to time since the Unix epoch, in ns.
+static int64_t clock_offset_ns;
+// Time at which the previous transfer completed.
+static uint64_t last_completion_ns;
+
+// A slot in the ring passing received data from the libusb event thread
+// to the writer thread. Each slot always holds one buffer; once the writer
+// has consumed its data, the buffer is swapped into the next transfer to
+// complete, so data is never copied.
+struct ring_slot {
+	// Buffer holding received data.
+	uint8_t *buffer;
+	// Number of bytes of data in the buffer.
+	int length;
+	// Time range over which the data was received.
+	uint64_t start_ns, end_ns;
+};
+
+static struct ring_slot ring[RING_SIZE];
+static uint8_t* ring_buffers;
+// Count of slots filled, written only by the libusb event thread.
+static atomic_uint ring_head = 0;
+// Count of slots consumed, written only by the writer thread.
+static atomic_uint ring_tail = 0;
+// Posted once for each slot filled, and once more to stop the writer.
+static sem_t ring_filled;
+// Greatest number of filled slots seen waiting for the writer.
+static unsigned int ring_high_water = 0;
+// Number of times the ring was full when a transfer completed.
+static unsigned int ring_stalls = 0;
+static pthread_t writer_thread;
+
+// Monotonic time as nanoseconds since Unix epoch.
+uint64_t capture_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000 + ts.tv_nsec + clock_offset_ns;
+}
+
+// Calculate offset from monotonic time to time since Unix epoch.
+void set_clock_offset(void)
+{
+	struct timespec mono, real;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_offset_ns =
+		(int64_t) (real.tv_sec - mono.tv_sec) * 1000000000 +
+		(real.tv_nsec - mono.tv_nsec);
+}
+
+// Pass a completed transfer's data to the writer thread, and give
+// the transfer a free buffer in exchange.
+void ring_push(struct libusb_transfer* transfer, uint64_t start_ns, uint64_t end_ns)
+{
+	unsigned int head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+
+	// If the ring is full, we have no choice but to wait for the writer.
+	if (head - tail == RING_SIZE) {
+		ring_stalls++;
+		do {
+			sched_yield();
+			tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+		} while (head - tail == RING_SIZE);
+	}
+
+	// Swap the transfer's buffer with the free one in the slot.
+	struct ring_slot *slot = &ring[head % RING_SIZE];
+	uint8_t *free_buffer = slot->buffer;
+	slot->buffer = transfer->buffer;
+	slot->length = transfer->actual_length;
+	slot->start_ns = start_ns;
+	slot->end_ns = end_ns;
+	transfer->buffer = free_buffer;
+
+	// Publish the slot to the writer.
+	atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+	sem_post(&ring_filled);
+
+	if (head + 1 - tail > ring_high_water)
+		ring_high_water = head + 1 - tail;
+}
+
+// Write to stdout, or to the decoder if decoding in-process.
+void write_output(const void *data, size_t length)
+{
+	if (decoder)
+		decoder_feed(decoder, data, length);
+	else
+		fwrite(data, length, 1, stdout);
+}
+
+// Writer thread: drain received data from the ring to the output.
+void *ring_writer(void *arg)
+{
+	while (1)
+	{
+		sem_wait(&ring_filled);
+
+		unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+		unsigned int head = atomic_load_explicit(&ring_head, memory_order_acquire);
+
+		// Woken with nothing to consume, so we are done.
+		if (tail == head)
+			break;
+
+		struct ring_slot *slot = &ring[tail % RING_SIZE];
+
+		if (timestamps) {
+			// Precede data with a header giving its time range.
+			struct block_header header = {
+				.start_ns = slot->start_ns,
+				.end_ns = slot->end_ns,
+				.length = slot->length,
+			};
+			block_header_swap(&header);
+			write_output(&header, sizeof(header));
+		}
+
+		write_output(slot->buffer, slot->length);
+
+		if (verbose)
+			TO_STDERR("Received %u bytes", slot->length);
+
+		// Release the slot for reuse.
+		atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+	}
+
+	fflush(stdout);
+
+	return NULL;
+}
+
+void usb_callback(struct libusb_transfer* transfer);
+
+// Allocate and fill a transfer, using the buffer with the same index.
+void prepare_transfer(int i)
+{
+	SET(usb_transfers[i], libusb_alloc_transfer(0));
+	libusb_fill_bulk_transfer(
+		usb_transfers[i],
+		usb_device,
+		ENDPOINT | LIBUSB_ENDPOINT_IN,
+		&usb_buffers[(size_t) i * transfer_size],
+		transfer_size,
+		usb_callback,
+		NULL,
+		timeout_ms);
+}
+
+// In adaptive mode, add another transfer in flight after a full completion,
+// since the device may already have had more data waiting.
+void adapt_depth(struct libusb_transfer* transfer)
+{
+	if (transfer->actual_length < transfer->length)
+		return;
+
+	completions_full++;
+
+	if (num_transfers >= max_transfers || capture_stopped)
+		return;
+
+	prepare_transfer(num_transfers);
+	CHECK(libusb_submit_transfer(usb_transfers[num_transfers]));
+	num_transfers++;
+
+	TO_STDERR("Raised transfer depth to %d", num_transfers);
+}
 
 void usb_callback(struct libusb_transfer* transfer)
 {
+	uint64_t completion_ns = capture_time();
+
 	switch (transfer->status)
 	{
 		case LIBUSB_TRANSFER_COMPLETED:
 		case LIBUSB_TRANSFER_TIMED_OUT:
-			if (capture_started) {
-				// Write received data to stdout.
-				fwrite(transfer->buffer,
-					transfer->actual_length,
-					1, stdout);
+			if (capture_started && transfer->actual_length > 0) {
+				// Hand received data over to the writer thread. It
+				// arrived after the previous transfer completed.
+				ring_push(transfer, last_completion_ns, completion_ns);
 			} else if (transfer->actual_length == 0) {
 				transfers_empty++;
 			}
@@ -61,7 +274,11 @@ void usb_callback(struct libusb_transfer* transfer)
 				// Resubmit transfer.
 				CHECK(libusb_submit_transfer(transfer));
 			}
-			TO_STDERR("Received %u bytes", transfer->actual_length);
+			if (capture_started) {
+				last_completion_ns = completion_ns;
+				completions++;
+				adapt_depth(transfer);
+			}
 			break;
 		default:
 			break;
@@ -90,8 +307,314 @@ void interrupt(int signum)
 	libusb_interrupt_event_handler(usb_context);
 }
 
+void print_summary(struct capture *capture)
+{
+	printf("%lu events, %lu packets, %lu transactions, %lu endpoints, %lu transfers\n",
+		capture->num_events,
+		capture->num_packets,
+		capture->num_transactions,
+		capture->num_endpoints,
+		capture->num_transfers);
+
+	if (capture->num_poll_runs > 0)
+		printf("%lu runs of repeated polls\n", capture->num_poll_runs);
+
+	if (triggered)
+		printf("%lu trigger hits\n", capture->num_trigger_hits);
+
+	for (int i = 0; i < capture->num_endpoints; i++) {
+		struct endpoint *ep = &capture->endpoints[i];
+		struct endpoint_traffic *traf = capture->endpoint_traffic[i];
+		printf("%u.%u: %lu transfers, %lu transactions\n",
+			ep->address, ep->endpoint_num,
+			traf->num_transfers, traf->num_transaction_ids);
+	}
+}
+
+// Parse an option argument which must be a whole number, decimal or with
+// a 0x prefix, no greater than max.
+//
+// Returns false if it is not one.
+bool parse_number(const char *arg, unsigned long max, unsigned long *value)
+{
+	char *end;
+	// strtoul() would accept leading space and negate a minus sign.
+	if (*arg < '0' || *arg > '9')
+		return false;
+	errno = 0;
+	*value = strtoul(arg, &end, 0);
+	return errno == 0 && *end == '\0' && *value <= max;
+}
+
+// Parse an option argument which must be a whole number as for
+// parse_number(), optionally followed by a K, M or G suffix.
+//
+// Returns false if it is not one, or the size does not fit in 64 bits.
+bool parse_size(const char *arg, uint64_t *size)
+{
+	char *end;
+	if (*arg < '0' || *arg > '9')
+		return false;
+	errno = 0;
+	unsigned long long value = strtoull(arg, &end, 0);
+	int shift = 0;
+	// Each suffix scales by 1024 on top of the next.
+	switch (*end) {
+		case 'G': shift += 10;
+			/* fallthrough */
+		case 'M': shift += 10;
+			/* fallthrough */
+		case 'K': shift += 10;
+			end++;
+			/* fallthrough */
+		case '\0': break;
+		default: return false;
+	}
+	if (errno != 0 || *end != '\0' || value > UINT64_MAX >> shift)
+		return false;
+	*size = (uint64_t) value << shift;
+	return true;
+}
+
+// Parse an option argument which must be a decimal number, such as a time,
+// with no sign, no greater than max.
+//
+// Returns false if it is not one.
+bool parse_decimal(const char *arg, double max, double *value)
+{
+	char *end;
+	// strtod() would also accept leading space, signs, infinity and NaN.
+	if ((*arg < '0' || *arg > '9') && *arg != '.')
+		return false;
+	errno = 0;
+	*value = strtod(arg, &end);
+	return errno == 0 && end != arg && *end == '\0' && *value <= max;
+}
+
+// Add the comma-separated conditions of a trigger specification.
+//
+// Returns false if the specification is not valid.
+bool parse_trigger(char *spec)
+{
+	static const char *handshakes[] = { "ack", "nak", "stall", "nyet" };
+	static const enum pid handshake_pids[] = { ACK, NAK, STALL, NYET };
+	int num_handshakes = 0;
+	unsigned long number;
+	double decimal;
+
+	for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+		char *value = strchr(item, '=');
+		if (value)
+			*value++ = '\0';
+		bool found = false;
+		for (int i = 0; i < 4; i++) {
+			if (strcmp(item, handshakes[i]) != 0)
+				continue;
+			// Handshake, optionally only from an address or endpoint,
+			// each with its own filter so that none match another's.
+			if (num_handshakes == TRIGGER_HANDSHAKES)
+				return false;
+			struct filter *filter = &trigger.handshakes[num_handshakes++];
+			filter->results = 1 << (handshake_pids[i] & PID_MASK);
+			if (value) {
+				char *endpoint = strchr(value, '.');
+				if (endpoint)
+					*endpoint++ = '\0';
+				if (!parse_number(value, 127, &number))
+					return false;
+				filter->addresses[number / 64] = 1ULL << (number % 64);
+				if (endpoint) {
+					if (!parse_number(endpoint, 15, &number))
+						return false;
+					filter->endpoints = 1 << number;
+				}
+			}
+			found = true;
+		}
+		if (found)
+			continue;
+		if (strcmp(item, "crc") == 0 && !value) {
+			trigger.crc_error = true;
+		} else if (!value) {
+			return false;
+		} else if (strcmp(item, "setup") == 0) {
+			if (!parse_number(value, 255, &number))
+				return false;
+			trigger.setup_requests[number / 64] |= 1ULL << (number % 64);
+		} else if (strcmp(item, "gap") == 0) {
+			if (!parse_decimal(value, INT64_MAX / 1e3, &decimal))
+				return false;
+			trigger.gap_ns = decimal * 1e3;
+		} else if (strcmp(item, "pre") == 0) {
+			if (!parse_decimal(value, INT64_MAX / 1e6, &decimal))
+				return false;
+			trigger.pre_ns = decimal * 1e6;
+		} else if (strcmp(item, "post") == 0) {
+			if (!parse_decimal(value, INT64_MAX / 1e6, &decimal))
+				return false;
+			trigger.post_ns = decimal * 1e6;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-d] [-o file] [-P] [-z] [-p] [-w size] [-W seconds] [-T conditions] [-r] [-v] [-n transfers] [-a max_transfers] [-s size] [-t timeout_ms]\n"
+		"  -d  decode in-process rather than writing to stdout\n"
+		"  -o  decode in-process, and save in indexed capture format to file\n"
+		"  -P  decode in-process on a pipeline of threads, at the cost of a copy\n"
+		"  -z  compress payload data when decoding in-process\n"
+		"  -p  collapse runs of NAKed polls when decoding in-process\n"
+		"  -w  keep only about this much recent data, with optional K, M or G suffix\n"
+		"  -W  keep only about this many seconds of recent data (in %d bytes unless -w)\n"
+		"  -T  keep only traffic around packets meeting any of these conditions, e.g.\n"
+		"      stall=3.1,setup=6,gap=500,crc,pre=100,post=100 for a STALL from\n"
+		"      address 3 endpoint 1 (ack, nak and nyet also work, with or without\n"
+		"      an address), a SETUP with bRequest 6, a gap over 500 us, a CRC error,\n"
+		"      and keeping from 100 ms before each to 100 ms after (default %d);\n"
+		"      up to %d handshakes, and not with -w or -W\n"
+		"  -r  write raw stream, without timestamps\n"
+		"  -v  report each buffer of data received\n"
+		"  -n  number of transfers in flight (default %d)\n"
+		"  -a  add transfers in flight while completions are full, up to this many\n"
+		"  -s  size of each transfer in bytes, a multiple of %d (default %d)\n"
+		"  -t  transfer timeout in milliseconds (default %d)\n",
+		name, DEFAULT_WINDOW_BYTES, DEFAULT_TRIGGER_MS, TRIGGER_HANDSHAKES, DEFAULT_NUM_TRANSFERS, MAX_PACKET_SIZE,
+		DEFAULT_TRANSFER_SIZE, DEFAULT_TIMEOUT_MS);
+	exit(-1);
+}
+
 int main(int argc, char *argv[])
 {
+	unsigned long value;
+	double seconds;
+	int opt;
+	while ((opt = getopt(argc, argv, "do:Pzpw:W:T:rvn:a:s:t:")) != -1) {
+		switch (opt) {
+			case 'd':
+				// Decode in-process rather than writing to stdout.
+				decode = true;
+				break;
+			case 'o':
+				// Decode in-process, then save decoded capture.
+				decode = true;
+				output_filename = optarg;
+				break;
+			case 'P':
+				// Decode on a pipeline of threads. Each packet is then
+				// copied into a batch, rather than parsed in place from
+				// the transfer buffer.
+				decode = true;
+				decoder_flags |= DECODER_PIPELINED;
+				break;
+			case 'z':
+				// Compress payload data when decoding.
+				decoder_flags |= DECODER_COMPRESSED;
+				break;
+			case 'p':
+				// Collapse runs of NAKed polls when decoding.
+				decoder_flags |= DECODER_POLL_RUNS;
+				break;
+			case 'w':
+				// Keep a rolling window of recent data when decoding.
+				decode = true;
+				if (!parse_size(optarg, &window_bytes) || !window_bytes)
+					usage(argv[0]);
+				break;
+			case 'W':
+				// Keep a rolling window of recent time when decoding.
+				decode = true;
+				if (!parse_decimal(optarg, INT64_MAX / 1e9, &seconds))
+					usage(argv[0]);
+				window_ns = seconds * 1e9;
+				if (!window_ns)
+					usage(argv[0]);
+				break;
+			case 'T':
+				// Keep only traffic around packets firing a trigger.
+				decode = true;
+				triggered = true;
+				if (!parse_trigger(optarg))
+					usage(argv[0]);
+				break;
+			case 'r':
+				// Write raw stream, without timestamps.
+				timestamps = false;
+				break;
+			case 'v':
+				// Report each buffer of data received.
+				verbose = true;
+				break;
+			case 'n':
+				if (!parse_number(optarg, INT_MAX, &value))
+					usage(argv[0]);
+				num_transfers = value;
+				break;
+			case 'a':
+				if (!parse_number(optarg, INT_MAX, &value))
+					usage(argv[0]);
+				max_transfers = value;
+				break;
+			case 's':
+				if (!parse_number(optarg, INT_MAX, &value))
+					usage(argv[0]);
+				transfer_size = value;
+				break;
+			case 't':
+				if (!parse_number(optarg, UINT_MAX, &value))
+					usage(argv[0]);
+				timeout_ms = value;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (num_transfers < 1 || transfer_size < MAX_PACKET_SIZE
+			|| transfer_size % MAX_PACKET_SIZE != 0)
+		usage(argv[0]);
+
+	// A decoder keeps either a rolling window or traffic around a trigger.
+	if (triggered && (window_bytes || window_ns))
+		usage(argv[0]);
+
+	if (max_transfers < num_transfers)
+		max_transfers = num_transfers;
+
+	if (decode) {
+		SET(decoder, decoder_open(decoder_flags));
+		if (window_ns && !window_bytes)
+			window_bytes = DEFAULT_WINDOW_BYTES;
+		if (window_bytes)
+			decoder_window(decoder, window_bytes, window_ns);
+		if (triggered)
+			decoder_trigger(decoder, &trigger, TRIGGER_HELD_BYTES);
+	}
+
+	// Allocate buffers for the most transfers we may have in flight.
+	SET(usb_transfers, calloc(max_transfers, sizeof(struct libusb_transfer *)));
+	SET(usb_buffers, malloc((size_t) max_transfers * transfer_size));
+	SET(ring_buffers, malloc((size_t) RING_SIZE * transfer_size));
+
+	// Identify output as a timestamped stream.
+	if (timestamps)
+		write_output(STREAM_MAGIC, STREAM_MAGIC_SIZE);
+
+	set_clock_offset();
+
+	// Set up ring and start writer thread.
+	for (int i = 0; i < RING_SIZE; i++)
+		ring[i].buffer = &ring_buffers[(size_t) i * transfer_size];
+	sem_init(&ring_filled, 0, 0);
+	if (pthread_create(&writer_thread, NULL, ring_writer, NULL) != 0) {
+		TO_STDERR("ERROR: %s failed", "pthread_create");
+		exit(-1);
+	}
+
 	// Set up libusb context.
 	CHECK(libusb_init(&usb_context));
 
@@ -105,31 +628,22 @@ int main(int argc, char *argv[])
 	CHECK(libusb_claim_interface(usb_device, 0));
 
 	// Prepare transfers.
-	for (int i = 0; i < NUM_TRANSFERS; i++) {
-		SET(usb_transfers[i], libusb_alloc_transfer(0));
-		libusb_fill_bulk_transfer(
-			usb_transfers[i],
-			usb_device,
-			ENDPOINT | LIBUSB_ENDPOINT_IN,
-			&usb_buffers[i][0],
-			TRANSFER_SIZE,
-			usb_callback,
-			NULL,
-			TIMEOUT_MS);
-	}
+	for (int i = 0; i < num_transfers; i++)
+		prepare_transfer(i);
 
 	// Disable capture.
 	set_capture_enable(false);
 
 	// Submit transfers.
-	for (int i = 0; i < NUM_TRANSFERS; i++)
+	for (int i = 0; i < num_transfers; i++)
 		CHECK(libusb_submit_transfer(usb_transfers[i]));
 
 	// Handle libusb events until all transfers return empty.
-	while (transfers_empty < NUM_TRANSFERS)
+	while (transfers_empty < num_transfers)
 		CHECK(libusb_handle_events(usb_context));
 
 	// Enable capture.
+	last_completion_ns = capture_time();
 	set_capture_enable(true);
 
 	capture_started = true;
@@ -144,8 +658,32 @@ int main(int argc, char *argv[])
 	capture_stopped = true;
 
 	// Handle libusb events until all transfers have completed.
-	while (transfers_stopped < NUM_TRANSFERS)
+	while (transfers_stopped < num_transfers)
 		CHECK(libusb_handle_events(usb_context));
 
+	// Let the writer drain the ring, then stop it.
+	sem_post(&ring_filled);
+	pthread_join(writer_thread, NULL);
+
+	TO_STDERR("Transfer depth %d, size %d, timeout %u ms: %lu of %lu completions full",
+		num_transfers, transfer_size, timeout_ms, completions_full, completions);
+	TO_STDERR("Ring high-water mark: %u of %u buffers, %u stalls",
+		ring_high_water, RING_SIZE, ring_stalls);
+
+	// Finish decoding and report results.
+	if (decoder) {
+		struct capture *capture = decoder_close(decoder);
+		if (!capture) {
+			TO_STDERR("ERROR: %s", "could not store decoded data");
+			exit(-1);
+		}
+		print_summary(capture);
+		if (output_filename && save_capture(capture, output_filename) != 0) {
+			TO_STDERR("ERROR: could not save %s", output_filename);
+			exit(-1);
+		}
+		close_capture(capture);
+	}
+
 	return 0;
 }
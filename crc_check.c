@@ -0,0 +1,111 @@
+// Check the table-driven CRCs used by the decoder against a bitwise
+// reference, exhaustively where the inputs are few enough.
+//
+// The library's CRC functions are private, so it is included whole.
+
+#include "library.c"
+
+// Reflected CRC of the given number of bits of a byte string, one bit at a
+// time, least significant bit of each byte first, as USB sends them.
+static uint32_t crc_reference(const uint8_t *data, size_t num_bits,
+	int width, uint32_t poly, uint32_t init)
+{
+	uint32_t mask = (1U << width) - 1;
+	uint32_t crc = init;
+	for (size_t i = 0; i < num_bits; i++) {
+		bool bit = (data[i / 8] >> (i % 8)) & 1;
+		crc = ((crc ^ bit) & 1) ? (crc >> 1) ^ poly : crc >> 1;
+	}
+	return ~crc & mask;
+}
+
+// CRC5 of the low bits of a value, by the reference.
+static uint8_t crc5_reference(uint32_t value, int num_bits)
+{
+	uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+	return crc_reference(bytes, num_bits, 5, CRC5_POLY, 0x1F);
+}
+
+// CRC16 of a byte string, by the reference.
+static uint16_t crc16_reference(const uint8_t *data, size_t length)
+{
+	return crc_reference(data, length * 8, 16, CRC16_POLY, 0xFFFF);
+}
+
+static int failures = 0;
+
+// Report a failed check.
+static void fail(const char *check, uint64_t input, uint32_t expected, uint32_t actual)
+{
+	if (failures++ < 10)
+		printf("%s: input 0x%lx: expected 0x%x, got 0x%x\n",
+			check, input, expected, actual);
+}
+
+int main(void)
+{
+	crc_tables_init();
+
+	// The reference must give the published check values of CRC-5/USB
+	// and CRC-16/USB for the ASCII string "123456789".
+	const uint8_t check_string[] = "123456789";
+	uint32_t check5 = crc_reference(check_string, 72, 5, CRC5_POLY, 0x1F);
+	uint32_t check16 = crc16_reference(check_string, 9);
+	if (check5 != 0x19)
+		fail("crc5 reference", 0, 0x19, check5);
+	if (check16 != 0xB4C8)
+		fail("crc16 reference", 0, 0xB4C8, check16);
+
+	// Every token and SOF value, by table and bit by bit.
+	for (uint32_t value = 0; value < (1 << TOKEN_CRC_BITS); value++) {
+		uint8_t expected = crc5_reference(value, TOKEN_CRC_BITS);
+		if (crc5_table[value] != expected)
+			fail("crc5 table", value, expected, crc5_table[value]);
+	}
+
+	// Every split value, as checked bit by bit by the decoder.
+	for (uint32_t value = 0; value < (1 << SPLIT_CRC_BITS); value++) {
+		uint8_t expected = crc5_reference(value, SPLIT_CRC_BITS);
+		uint8_t actual = crc5_bits(value, SPLIT_CRC_BITS);
+		if (actual != expected)
+			fail("crc5 split", value, expected, actual);
+	}
+
+	// Every payload of one or two bytes, which take only the bytewise path.
+	for (uint32_t value = 0; value < 0x10000; value++) {
+		uint8_t bytes[2] = { value, value >> 8 };
+		size_t length = value < 0x100 ? 1 : 2;
+		uint16_t expected = crc16_reference(bytes, length);
+		uint16_t actual = crc16(bytes, length);
+		if (actual != expected)
+			fail("crc16 short", value, expected, actual);
+	}
+
+	// Each byte value at each position of a slice, and payloads of every
+	// length up to the largest, at every alignment.
+	uint8_t payload[CRC16_SLICE + 1024];
+	for (int position = 0; position < CRC16_SLICE; position++)
+		for (int byte = 0; byte < 256; byte++) {
+			memset(payload, 0x5A, CRC16_SLICE);
+			payload[position] = byte;
+			uint16_t expected = crc16_reference(payload, CRC16_SLICE);
+			uint16_t actual = crc16(payload, CRC16_SLICE);
+			if (actual != expected)
+				fail("crc16 slice", position << 8 | byte, expected, actual);
+		}
+	uint32_t state = 1;
+	for (size_t i = 0; i < sizeof(payload); i++) {
+		state = state * 1103515245 + 12345;
+		payload[i] = state >> 16;
+	}
+	for (int offset = 0; offset < CRC16_SLICE; offset++)
+		for (size_t length = 0; length <= 1024; length++) {
+			uint16_t expected = crc16_reference(&payload[offset], length);
+			uint16_t actual = crc16(&payload[offset], length);
+			if (actual != expected)
+				fail("crc16 payload", offset << 16 | length, expected, actual);
+		}
+
+	printf("%s: %d failures\n", failures ? "FAILED" : "CRCs OK", failures);
+	return failures ? -1 : 0;
+}
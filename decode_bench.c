@@ -0,0 +1,264 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "library.h"
+
+#define DEFAULT_RUNS 3
+// Number of random times looked up when timing seeking.
+#define SEEK_LOOKUPS 1000000
+
+// Time in seconds from an arbitrary start point.
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Peak resident set size of the process so far, in MiB.
+static double peak_rss(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+}
+
+// Total size of the arrays in a capture, in MiB.
+static double capture_size(struct capture *capture)
+{
+	uint64_t size =
+		capture->num_events * sizeof(struct event) +
+		capture->num_packets * (sizeof(uint8_t) + 2 * sizeof(uint16_t) + sizeof(uint32_t)) +
+		capture->num_checkpoints * sizeof(struct packet_checkpoint) +
+		capture->num_transactions * (sizeof(struct transaction) +
+			sizeof(struct transaction_info) + sizeof(uint64_t)) +
+		capture->num_endpoints * sizeof(struct endpoint) +
+		capture->num_transfers * (sizeof(struct transfer_index_entry) + sizeof(uint64_t)) +
+		capture->data_stored_size +
+		capture->num_data_blocks * sizeof(struct data_block) +
+		capture->num_packet_summaries * sizeof(uint16_t) +
+		capture->num_transaction_summaries * sizeof(struct filter) +
+		capture->num_crc_error_words * sizeof(uint64_t) +
+		capture->num_poll_runs * sizeof(struct poll_run);
+	for (int i = 0; i < capture->num_endpoints; i++) {
+		struct endpoint_traffic *traf = capture->endpoint_traffic[i];
+		size += traf->num_transfers * (sizeof(struct transfer) + sizeof(struct transfer_info)) +
+			traf->num_transaction_ids * sizeof(uint64_t);
+	}
+	return size / 1048576.0;
+}
+
+// Report the time taken for a stage of decoding.
+static void report(const char *stage, double time, uint64_t num_packets, uint64_t num_bytes)
+{
+	printf("%-16s %8.3f s %10.2f Mpackets/s %8.1f MB/s\n",
+		stage, time, num_packets / time / 1e6, num_bytes / time / 1e6);
+}
+
+// Time looking up packets, transactions and events at random times.
+static void seek_times(struct capture *capture)
+{
+	struct packet first, last;
+
+	if (capture->num_packets == 0)
+		return;
+
+	capture_packet(capture, 0, &first);
+	capture_packet(capture, capture->num_packets - 1, &last);
+	uint64_t span = last.timestamp_ns - first.timestamp_ns + 1;
+
+	double start = seconds();
+	for (int i = 0; i < SEEK_LOOKUPS; i++) {
+		uint64_t timestamp_ns = first.timestamp_ns + (uint64_t) (drand48() * span);
+		capture_packet_at(capture, timestamp_ns);
+		capture_transaction_at(capture, timestamp_ns);
+		capture_event_at(capture, timestamp_ns);
+	}
+	double time = seconds() - start;
+
+	printf("%-16s %8.3f s %10.2f Mlookups/s\n", "seek", time, SEEK_LOOKUPS / time / 1e6);
+}
+
+// Time filtering transactions by address and result, and packets by PID.
+static void filter_times(struct capture *capture)
+{
+	struct filter by_result = {
+		.addresses = { 1 << 1 },
+		.results = 1 << (NAK & PID_MASK),
+	};
+	struct filter by_pid = {
+		.pids = 1 << (SETUP & PID_MASK),
+	};
+
+	double start = seconds();
+	struct filter_view *transactions = filter_transactions(capture, &by_result);
+	double filtered = seconds();
+	struct filter_view *packets = filter_packets(capture, &by_pid);
+	double time = seconds() - filtered;
+
+	printf("%-16s %8.3f s %10lu transactions\n", "filter results",
+		filtered - start, view_count(transactions));
+	printf("%-16s %8.3f s %10lu packets\n", "filter PIDs",
+		time, view_count(packets));
+
+	view_close(transactions);
+	view_close(packets);
+}
+
+// Time exporting the packets of one device to pcap, discarding the output.
+static void export_times(struct capture *capture)
+{
+	struct filter by_address = {
+		.addresses = { 1 << 1 },
+	};
+
+	double start = seconds();
+	int64_t count = capture_export(capture, "/dev/null", &by_address, 0, UINT64_MAX, EXPORT_PCAP);
+	double time = seconds() - start;
+
+	printf("%-16s %8.3f s %10ld packets\n", "export address", time, count);
+}
+
+// Time sorting transactions by duration and transfers by data length.
+static void sort_times(struct capture *capture)
+{
+	double start = seconds();
+	struct sort_index *transactions = sort_transactions(capture, NULL, SORT_DURATION);
+	double sorted = seconds();
+	struct sort_index *transfers = sort_transfers(capture, SORT_DATA_LENGTH);
+	double time = seconds() - sorted;
+
+	printf("%-16s %8.3f s %10lu transactions\n", "sort durations",
+		sorted - start, sort_count(transactions));
+	printf("%-16s %8.3f s %10lu transfers\n", "sort lengths",
+		time, sort_count(transfers));
+
+	sort_close(transactions);
+	sort_close(transfers);
+}
+
+// Decode data already in memory with a decoder, timing each stage.
+static void decode_stages(unsigned int flags,
+	const uint8_t *data, size_t length, double *feed_time, double *close_time,
+	uint64_t *num_packets, double *size)
+{
+	double start = seconds();
+	struct decoder *decoder = decoder_open(flags);
+	if (!decoder) {
+		printf("Failed to open decoder\n");
+		exit(-1);
+	}
+	decoder_feed(decoder, data, length);
+	double fed = seconds();
+	struct capture *capture = decoder_close(decoder);
+	double closed = seconds();
+	if (!capture) {
+		printf("Failed to decode\n");
+		exit(-1);
+	}
+
+	*feed_time = fed - start;
+	*close_time = closed - fed;
+	*num_packets = capture->num_packets;
+	*size = capture_size(capture);
+
+	close_capture(capture);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		printf("Usage: %s <filename> [runs]\n", argv[0]);
+		return -1;
+	}
+
+	char *filename = argv[1];
+	int runs = (argc > 2) ? atoi(argv[2]) : DEFAULT_RUNS;
+	if (runs < 1)
+		runs = 1;
+	struct stat st;
+
+	if (stat(filename, &st) != 0) {
+		printf("Failed to open %s\n", filename);
+		return -1;
+	}
+
+	// Time whole-file conversion, keeping the best of several runs.
+	// The last capture is kept for timing seeking.
+	double best = 0, size = 0;
+	uint64_t num_packets = 0;
+	struct capture *capture = NULL;
+	for (int i = 0; i < runs; i++) {
+		if (capture)
+			close_capture(capture);
+		double start = seconds();
+		capture = convert_capture(filename);
+		double time = seconds() - start;
+		if (!capture) {
+			printf("Failed to decode %s\n", filename);
+			return -1;
+		}
+		if (i == 0 || time < best)
+			best = time;
+		num_packets = capture->num_packets;
+		size = capture_size(capture);
+	}
+
+	printf("%s: %lu bytes, %lu packets, %ld CPUs\n",
+		filename, st.st_size, num_packets, sysconf(_SC_NPROCESSORS_ONLN));
+	report("convert_capture", best, num_packets, st.st_size);
+	printf("%-16s %8.1f MiB\n", "capture size", size);
+	printf("%-16s %8.1f MiB\n", "peak RSS", peak_rss());
+	seek_times(capture);
+	filter_times(capture);
+	sort_times(capture);
+	export_times(capture);
+	close_capture(capture);
+
+	// Read the file into memory, so that stages can be timed separately.
+	double start = seconds();
+	uint8_t *data = malloc(st.st_size);
+	int fd = open(filename, O_RDONLY);
+	size_t length = 0;
+	ssize_t count;
+	while (length < st.st_size &&
+			(count = read(fd, data + length, st.st_size - length)) > 0)
+		length += count;
+	close(fd);
+	report("read", seconds() - start, num_packets, length);
+
+	// Time feeding and closing a decoder, with and without the pipeline,
+	// with payload data compressed, and with runs of polls collapsed.
+	double feed_time, close_time;
+	decode_stages(0, data, length,
+		&feed_time, &close_time, &num_packets, &size);
+	report("serial feed", feed_time, num_packets, length);
+	report("serial close", close_time, num_packets, length);
+	decode_stages(DECODER_PIPELINED, data, length,
+		&feed_time, &close_time, &num_packets, &size);
+	report("pipelined feed", feed_time, num_packets, length);
+	report("pipelined close", close_time, num_packets, length);
+	decode_stages(DECODER_PIPELINED | DECODER_COMPRESSED, data, length,
+		&feed_time, &close_time, &num_packets, &size);
+	report("compressed feed", feed_time, num_packets, length);
+	report("compressed close", close_time, num_packets, length);
+	printf("%-16s %8.1f MiB\n", "compressed size", size);
+	// Rates are of packets in the stream, not the fewer packets stored.
+	uint64_t num_stored;
+	decode_stages(DECODER_PIPELINED | DECODER_POLL_RUNS, data, length,
+		&feed_time, &close_time, &num_stored, &size);
+	report("poll runs feed", feed_time, num_packets, length);
+	report("poll runs close", close_time, num_packets, length);
+	printf("%-16s %8.1f MiB %10lu packets stored\n", "poll runs size", size, num_stored);
+
+	free(data);
+
+	return 0;
+}
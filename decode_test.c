@@ -2,19 +2,24 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "library.h"
 
 int main(int argc, char *argv[])
 {
 	if (argc < 2) {
-		printf("Usage: %s <filename>\n", argv[0]);
+		printf("Usage: %s <filename> [indexed, .pcap or .pcapng output filename]\n", argv[0]);
 		return -1;
 	}
 
 	char *filename = argv[1];
 
-	struct capture *capture = convert_capture(filename);
+	struct capture *capture = open_capture(filename);
+	if (!capture) {
+		printf("%s: could not decode\n", filename);
+		return -1;
+	}
 
 	printf("%s: %lu events, %lu packets, %lu transactions, %lu endpoints, %lu transfers\n",
 		filename,
@@ -32,6 +37,24 @@ int main(int argc, char *argv[])
 			traf->num_transfers, traf->num_transaction_ids);
 	}
 
+	if (argc > 2) {
+		// Export packets for Wireshark if the output is named for it,
+		// otherwise save in indexed capture format.
+		char *suffix = strrchr(argv[2], '.');
+		struct filter all = { 0 };
+		int64_t result;
+		if (suffix && strcmp(suffix, ".pcap") == 0)
+			result = capture_export(capture, argv[2], &all, 0, UINT64_MAX, EXPORT_PCAP);
+		else if (suffix && strcmp(suffix, ".pcapng") == 0)
+			result = capture_export(capture, argv[2], &all, 0, UINT64_MAX, EXPORT_PCAPNG);
+		else
+			result = save_capture(capture, argv[2]);
+		if (result < 0) {
+			printf("Failed to save %s\n", argv[2]);
+			return -1;
+		}
+	}
+
 	close_capture(capture);
 
 	return 0;
@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include "library.h"
+#include "stream.h"
+
+#define DEFAULT_SIZE 0x10000000
+#define DEFAULT_SEED 1
+#define BLOCK_SIZE 256*1024
+#define MAX_PACKET_SIZE 1027
+// Time taken to receive each byte of the stream, for timestamps.
+#define NS_PER_BYTE 20
+// Start time of a timestamped stream, in ns since Unix epoch.
+#define START_NS 1600000000000000000ULL
+// Number of payloads in a bulk write of zeroes, enough to fill at least one
+// whole block of compressed payload data.
+#define FILL_PACKETS 256
+
+// Whether to write a timestamped stream.
+static bool timestamps = false;
+// Whether to write compressible payloads, rather than only random ones.
+static bool compressible = false;
+// Whether to give split packets valid CRCs, rather than random bytes.
+static bool valid_splits = false;
+// Number of bytes written so far.
+static uint64_t bytes_written = 0;
+// Data for the current block of a timestamped stream.
+static uint8_t block[BLOCK_SIZE];
+// Number of bytes in the current block.
+static size_t block_length = 0;
+// State of the random number generator.
+static uint64_t random_state;
+// Current frame number, for SOF packets.
+static uint16_t frame = 0;
+
+// Random number in the range [0, limit).
+static uint32_t random_below(uint32_t limit)
+{
+	// xorshift64*
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return ((random_state * 0x2545F4914F6CDD1DULL) >> 32) % limit;
+}
+
+// True with the given percentage probability.
+static bool chance(uint32_t percent)
+{
+	return random_below(100) < percent;
+}
+
+// Write the current block of a timestamped stream, with its header.
+static void block_flush(void)
+{
+	uint64_t block_start = bytes_written - block_length;
+	struct block_header header = {
+		.start_ns = START_NS + block_start * NS_PER_BYTE,
+		.end_ns = START_NS + bytes_written * NS_PER_BYTE,
+		.length = block_length,
+	};
+	block_header_swap(&header);
+	fwrite(&header, sizeof(header), 1, stdout);
+	fwrite(block, 1, block_length, stdout);
+	block_length = 0;
+}
+
+// Write bytes of raw stream data.
+static void stream_write(const uint8_t *data, size_t length)
+{
+	if (!timestamps) {
+		fwrite(data, 1, length, stdout);
+		bytes_written += length;
+		return;
+	}
+
+	while (length > 0)
+	{
+		size_t count = BLOCK_SIZE - block_length;
+		if (count > length)
+			count = length;
+		memcpy(&block[block_length], data, count);
+		block_length += count;
+		bytes_written += count;
+		data += count;
+		length -= count;
+		if (block_length == BLOCK_SIZE)
+			block_flush();
+	}
+}
+
+// Write a packet, preceded by its length.
+static void packet(const uint8_t *data, uint16_t length)
+{
+	uint8_t prefix[2] = { length >> 8, length & 0xFF };
+	stream_write(prefix, 2);
+	stream_write(data, length);
+}
+
+// CRC5 of the given number of bits of a token, SOF or split packet.
+static uint8_t crc5(uint32_t value, int num_bits)
+{
+	uint8_t crc = 0x1F;
+	for (int i = 0; i < num_bits; i++) {
+		bool bit = (value >> i) & 1;
+		crc = ((crc ^ bit) & 1) ? (crc >> 1) ^ 0x14 : crc >> 1;
+	}
+	return ~crc & 0x1F;
+}
+
+// CRC16 of the payload of a data packet.
+static uint16_t crc16(const uint8_t *data, size_t length)
+{
+	uint16_t crc = 0xFFFF;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (int j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return ~crc;
+}
+
+// Write a packet containing just a PID.
+static void handshake(enum pid pid)
+{
+	uint8_t byte = pid;
+	packet(&byte, 1);
+}
+
+// Write a token packet, optionally with a bad CRC.
+static void token(enum pid pid, uint8_t address, uint8_t endpoint_num, bool bad_crc)
+{
+	uint16_t value = address | endpoint_num << 7;
+	value |= (crc5(value, 11) ^ bad_crc) << 11;
+	uint8_t data[3] = { pid, value & 0xFF, value >> 8 };
+	packet(data, 3);
+}
+
+// Write a SOF packet for the next frame.
+static void sof(void)
+{
+	frame = (frame + 1) & 0x7FF;
+	uint16_t value = frame | crc5(frame, 11) << 11;
+	uint8_t data[3] = { SOF, value & 0xFF, value >> 8 };
+	packet(data, 3);
+}
+
+// Write a data packet, optionally with a bad CRC.
+//
+// Payloads are random, or if compressible, out of every ten, one is zeroes,
+// six are random and three repeat the previous payload, as seen with status
+// polling and retransmissions.
+static void data_packet(enum pid pid, size_t length, bool bad_crc)
+{
+	static uint8_t buf[MAX_PACKET_SIZE];
+	int kind = compressible ? random_below(10) : 1;
+	buf[0] = pid;
+	if (kind < 1)
+		memset(&buf[1], 0, length);
+	else if (kind < 7)
+		for (size_t i = 0; i < length; i++)
+			buf[1 + i] = random_below(256);
+	// Otherwise, leave the previous payload in place.
+	uint16_t crc = crc16(&buf[1], length) ^ bad_crc;
+	buf[1 + length] = crc & 0xFF;
+	buf[2 + length] = crc >> 8;
+	packet(buf, length + 3);
+}
+
+// Burst of SOF packets on an idle bus.
+static void sof_burst(void)
+{
+	int count = 1 + random_below(8);
+	for (int i = 0; i < count; i++)
+		sof();
+}
+
+// Bulk IN transaction, possibly preceded by a storm of NAKs.
+static void bulk_in(void)
+{
+	uint8_t address = 1 + random_below(3);
+	uint8_t endpoint_num = 1 + random_below(2);
+
+	if (chance(30)) {
+		int naks = random_below(200);
+		for (int i = 0; i < naks; i++) {
+			token(IN, address, endpoint_num, false);
+			handshake(NAK);
+		}
+	}
+
+	token(IN, address, endpoint_num, false);
+	if (chance(10)) {
+		handshake(chance(50) ? NAK : STALL);
+		return;
+	}
+	static const size_t sizes[] = { 0, 13, 64, 512 };
+	data_packet(chance(50) ? DATA0 : DATA1, sizes[random_below(4)], chance(1));
+	if (chance(97))
+		handshake(ACK);
+}
+
+// Bulk OUT transaction, possibly NAKed or stalled.
+static void bulk_out(void)
+{
+	uint8_t address = 1 + random_below(2);
+	static const size_t sizes[] = { 0, 31, 512, 512 };
+	token(OUT, address, 3, false);
+	data_packet(chance(50) ? DATA0 : DATA1, sizes[random_below(4)], chance(1));
+	int outcome = random_below(10);
+	handshake(outcome < 7 ? ACK : outcome < 9 ? NAK : STALL);
+}
+
+// Long bulk OUT write of zeroes, as when erasing a storage device.
+static void bulk_fill(void)
+{
+	uint8_t buf[3 + 512] = { 0 };
+	uint16_t crc = crc16(&buf[1], 512);
+	buf[513] = crc & 0xFF;
+	buf[514] = crc >> 8;
+	for (int i = 0; i < FILL_PACKETS; i++) {
+		token(OUT, 1, 3, false);
+		buf[0] = i % 2 ? DATA1 : DATA0;
+		packet(buf, sizeof(buf));
+		handshake(ACK);
+	}
+}
+
+// Control transfer, with a data stage in either direction.
+static void control(void)
+{
+	uint8_t address = random_below(4);
+	bool in = chance(70);
+
+	// Setup stage.
+	token(SETUP, address, 0, false);
+	data_packet(DATA0, 8, false);
+	handshake(ACK);
+
+	// Data stage.
+	int count = random_below(4);
+	for (int i = 0; i < count; i++) {
+		token(in ? IN : OUT, address, 0, false);
+		if (in && chance(30)) {
+			handshake(NAK);
+			continue;
+		}
+		data_packet(i % 2 ? DATA0 : DATA1, 1 + random_below(64), false);
+		handshake(ACK);
+	}
+
+	// Status stage, sometimes missing.
+	if (chance(90)) {
+		token(in ? OUT : IN, address, 0, false);
+		data_packet(DATA1, 0, false);
+		handshake(ACK);
+	}
+}
+
+// Split transaction to a full or low speed device behind a hub.
+static void split(void)
+{
+	if (valid_splits) {
+		uint32_t value = random_below(1 << 19);
+		value |= crc5(value, 19) << 19;
+		uint8_t buf[4] = { SPLIT, value & 0xFF, (value >> 8) & 0xFF, value >> 16 };
+		packet(buf, 4);
+	} else {
+		uint8_t buf[4] = { SPLIT, random_below(128), random_below(256), random_below(256) };
+		packet(buf, 4);
+	}
+	token(chance(50) ? IN : OUT, 4 + random_below(4), 1, false);
+	handshake(chance(50) ? ACK : NYET);
+}
+
+// Malformed packet of some kind.
+static void malformed(void)
+{
+	uint8_t buf[4];
+	for (int i = 0; i < 4; i++)
+		buf[i] = random_below(256);
+
+	switch (random_below(6))
+	{
+	case 0:
+		// Token with bad CRC.
+		token(IN, random_below(128), random_below(16), true);
+		break;
+	case 1:
+		// Truncated token.
+		buf[0] = chance(50) ? IN : OUT;
+		packet(buf, 1 + random_below(2));
+		break;
+	case 2:
+		// Zero-length packet.
+		packet(buf, 0);
+		break;
+	case 3:
+		// Random bytes, usually a PID with bad check bits.
+		packet(buf, 1 + random_below(3));
+		break;
+	case 4:
+		// Handshake out of sequence.
+		handshake(chance(50) ? ACK : NAK);
+		break;
+	case 5:
+		// Data packet shorter than its CRC.
+		buf[0] = DATA0;
+		packet(buf, 2);
+		break;
+	}
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-s size] [-r seed] [-t] [-z] [-c]\n"
+		"  -s  size of stream data in bytes, with optional K, M or G suffix (default %d)\n"
+		"  -r  seed for random traffic (default %d)\n"
+		"  -t  write timestamped stream, rather than raw\n"
+		"  -z  mix zeroed and repeated payloads, and long writes of zeroes, in\n"
+		"      with random ones, to exercise payload compression\n"
+		"  -c  give split packets valid CRCs, so only deliberately bad packets fail\n",
+		name, DEFAULT_SIZE, DEFAULT_SEED);
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t size = DEFAULT_SIZE;
+	uint64_t seed = DEFAULT_SEED;
+	char *suffix;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:r:tzc")) != -1) {
+		switch (opt) {
+			case 's':
+				size = strtoull(optarg, &suffix, 0);
+				// Each suffix scales by 1024 on top of the next.
+				switch (*suffix) {
+					case 'G': size <<= 10;
+					case 'M': size <<= 10;
+					case 'K': size <<= 10;
+					case '\0': break;
+					default: usage(argv[0]);
+				}
+				break;
+			case 'r':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			case 't':
+				timestamps = true;
+				break;
+			case 'z':
+				compressible = true;
+				break;
+			case 'c':
+				valid_splits = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	// Seed must be nonzero for xorshift.
+	random_state = seed * 0x9E3779B97F4A7C15ULL | 1;
+
+	if (timestamps)
+		fwrite(STREAM_MAGIC, 1, STREAM_MAGIC_SIZE, stdout);
+
+	// Generate traffic until the requested size is reached. Options add
+	// to the default traffic rather than changing it, so that streams from
+	// the same seed stay comparable between builds.
+	while (bytes_written < size)
+	{
+		if (compressible && random_below(10000) == 0) {
+			bulk_fill();
+			continue;
+		}
+		int choice = random_below(100);
+		if (choice < 20)
+			sof_burst();
+		else if (choice < 50)
+			bulk_in();
+		else if (choice < 65)
+			bulk_out();
+		else if (choice < 85)
+			control();
+		else if (choice < 92)
+			split();
+		else
+			malformed();
+	}
+
+	if (timestamps && block_length > 0)
+		block_flush();
+
+	return 0;
+}
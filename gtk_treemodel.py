@@ -14,8 +14,47 @@ class EventTreeModel(GObject.GObject, Gtk.TreeModel):
     def __init__(self, capture):
         super().__init__()
         self.capture = capture
+        self.generation = capture.window_generation
         self.root_item = EventTreeItem.root(capture)
         self.cache[id(self.root_item)] = self.root_item
+        self.rows = self.root_item.child_count()
+        self.growing = {}
+
+    # Notify views of top level events added since the last update, and of
+    # children added to items that were still growing.
+    def update(self):
+        count = self.root_item.child_count()
+        for index in range(self.rows, count):
+            iterator = Gtk.TreeIter()
+            self.store(self.root_item.child_item(index), iterator)
+            self.row_inserted(Gtk.TreePath.new_from_indices([index]), iterator)
+        self.rows = count
+        for item, rows in list(self.growing.items()):
+            count = item.child_count()
+            parent_path = self.item_path(item)
+            for index in range(rows, count):
+                iterator = Gtk.TreeIter()
+                self.store(item.child_item(index), iterator)
+                path = parent_path.copy()
+                path.append_index(index)
+                self.growing[item] = index + 1
+                self.row_inserted(path, iterator)
+            if rows == 0 and count > 0:
+                iterator = Gtk.TreeIter()
+                self.store(item, iterator)
+                self.row_has_child_toggled(parent_path, iterator)
+            if not item.may_grow():
+                del self.growing[item]
+
+    # Get the number of children of an item, tracking items that may still
+    # gain children so that their new rows can be announced.
+    def child_count(self, item):
+        if item in self.growing:
+            return self.growing[item]
+        count = item.child_count()
+        if item.may_grow():
+            self.growing[item] = count
+        return count
 
     # Retrieve EventTreeItem from a Gtk.TreeIter.
     @classmethod
@@ -33,14 +72,17 @@ class EventTreeModel(GObject.GObject, Gtk.TreeModel):
     def do_get_column_type(self, index):
         return str
 
-    def do_get_path(self, iterator):
-        item = self.retrieve(iterator)
+    # Get the path of an item.
+    def item_path(self, item):
         path = Gtk.TreePath()
         while item.child_index is not None:
             path.prepend_index(item.child_index)
             item = item.parent
         return path
 
+    def do_get_path(self, iterator):
+        return self.item_path(self.retrieve(iterator))
+
     def do_get_iter(self, path):
         indices = path.get_indices()
         depth = path.get_depth()
@@ -57,7 +99,7 @@ class EventTreeModel(GObject.GObject, Gtk.TreeModel):
         item = self.retrieve(iterator)
         if item.parent is None:
             return False
-        if item.child_index >= item.parent.child_count() - 1:
+        if item.child_index >= self.child_count(item.parent) - 1:
             return False
         next_item = item.parent.child_item(item.child_index + 1)
         self.store(next_item, iterator)
@@ -75,18 +117,18 @@ class EventTreeModel(GObject.GObject, Gtk.TreeModel):
 
     def do_iter_has_child(self, iterator):
         item = self.retrieve(iterator)
-        return item.child_count() > 0
+        return self.child_count(item) > 0
 
     def do_iter_n_children(self, iterator):
         item = self.retrieve(iterator)
-        return item.child_count()
+        return self.child_count(item)
 
     def do_iter_children(self, parent):
         if parent is None:
             parent_item = self.root_item
         else:
             parent_item = self.retrieve(parent)
-        if parent_item.child_count() == 0:
+        if self.child_count(parent_item) == 0:
             return (False, None)
         child_item = parent_item.child_item(0)
         iterator = Gtk.TreeIter()
@@ -98,7 +140,7 @@ class EventTreeModel(GObject.GObject, Gtk.TreeModel):
             parent_item = self.root_item
         else:
             parent_item = self.retrieve(parent)
-        if n >= parent_item.child_count():
+        if n >= self.child_count(parent_item):
             return (False, None)
         child_item = parent_item.child_item(n)
         iterator = Gtk.TreeIter()
@@ -1,20 +1,33 @@
 import gi
 gi.require_version('Gtk', '3.0')
-from gi.repository import Gtk, GObject
+from gi.repository import Gtk, GObject, GLib
 from treeitem import EventTreeItem
 from gtk_treemodel import *
 from interface import *
 import faulthandler
 import sys
+import os
 
 faulthandler.enable()
 
-if len(sys.argv) != 2:
-    print("Usage: %s <capture file>" % sys.argv[0])
+if len(sys.argv) not in (2, 3):
+    print("Usage: %s <capture file | - [window MiB]>" % sys.argv[0])
     sys.exit(-1)
 
-# Load capture
-capture = convert_capture(sys.argv[1].encode('ascii'))
+# Load capture, or start decoding one live from standard input,
+# optionally keeping only a rolling window of recent traffic.
+if sys.argv[1] == '-':
+    decoder = decoder_open(DECODER_PIPELINED)
+    if not decoder:
+        print("Could not open decoder", file=sys.stderr)
+        sys.exit(-1)
+    if len(sys.argv) == 3:
+        decoder_window(decoder, int(sys.argv[2]) << 20, 0)
+    capture = decoder_snapshot(decoder)
+    os.set_blocking(sys.stdin.fileno(), False)
+else:
+    decoder = None
+    capture = open_capture(sys.argv[1].encode('ascii'))
 
 # Set up and run GUI
 model = EventTreeModel(capture)
@@ -25,5 +38,36 @@ window.connect('destroy', lambda *a: Gtk.main_quit())
 view = builder.get_object("view")
 view.set_model(model)
 view.append_column(Gtk.TreeViewColumn('Event', Gtk.CellRendererText(), text=0))
+
+# Decode whatever has arrived on standard input, and update view.
+def poll(source, condition):
+    global decoder, model
+    for i in range(64):
+        result = decoder_read(decoder, sys.stdin.fileno())
+        if result <= 0:
+            break
+    if result == 0:
+        # End of stream; complete the capture.
+        stored = decoder_close(decoder)
+        decoder = None
+    else:
+        stored = decoder_snapshot(decoder)
+    if not stored:
+        # The capture is incomplete, and no longer usable.
+        print("Decoded data could not be stored", file=sys.stderr)
+        Gtk.main_quit()
+        return False
+    if capture.window_generation != model.generation:
+        # The capture was rebuilt from a rolling window; start afresh.
+        model = EventTreeModel(capture)
+        view.set_model(model)
+    else:
+        model.update()
+    return decoder is not None
+
+if decoder is not None:
+    GLib.io_add_watch(sys.stdin.fileno(), GLib.PRIORITY_DEFAULT,
+        GLib.IO_IN | GLib.IO_HUP, poll)
+
 window.show_all()
 Gtk.main()
@@ -16,4 +16,73 @@ pid_names = [
         "SPLIT", "IN", "NAK", "DATA1",
         "ERR", "SETUP", "STALL", "MDATA"]
 
-__all__ += ['pid_names']
+def get_packet(capture, packet_id):
+    packet = ffi.new("struct packet *")
+    capture_packet(capture, packet_id, packet)
+    return packet
+
+def get_data(capture, offset, length):
+    data = ffi.new("uint8_t[]", length)
+    capture_data(capture, offset, length, data)
+    return ffi.buffer(data)[:]
+
+# Build a filter from collections of addresses, endpoint numbers, PIDs
+# and result PIDs. Empty collections match anything.
+def make_filter(addresses=(), endpoints=(), pids=(), results=()):
+    filter = ffi.new("struct filter *")
+    for address in addresses:
+        filter.addresses[address // 64] |= 1 << (address % 64)
+    for endpoint_num in endpoints:
+        filter.endpoints |= 1 << endpoint_num
+    for pid in pids:
+        filter.pids |= 1 << (pid & PID_MASK)
+    for pid in results:
+        filter.results |= 1 << (pid & PID_MASK)
+    return filter
+
+def packet_view(capture, filter):
+    return checked_view(filter_packets(capture, filter))
+
+def transaction_view(capture, filter):
+    return checked_view(filter_transactions(capture, filter))
+
+def checked_view(view):
+    if view == ffi.NULL:
+        raise MemoryError("no memory to filter capture")
+    return ffi.gc(view, view_close)
+
+# Sort the transactions in a capture, or those selected by a view, by a key.
+def transaction_order(capture, view, key):
+    return sort_order(sort_transactions(capture, view or ffi.NULL, key))
+
+def transfer_order(capture, key):
+    return sort_order(sort_transfers(capture, key))
+
+def sort_order(index):
+    if index == ffi.NULL:
+        raise MemoryError("no memory to sort capture")
+    return ffi.gc(index, sort_close)
+
+# Buffer for formatting rows of a table.
+def format_buffer(size=0x100000):
+    return ffi.new("char[]", size)
+
+# Format rows of a table with a function like capture_format_packets(),
+# given its arguments before the first row, of which None is passed as
+# NULL. Returns a list of the cells of each row.
+def format_rows(function, args, first_row, num_rows, buffer):
+    args = [ffi.NULL if arg is None else arg for arg in args]
+    rows = []
+    while len(rows) < num_rows:
+        count = function(*args, first_row + len(rows),
+            num_rows - len(rows), buffer, len(buffer))
+        if count == 0:
+            break
+        lines = ffi.string(buffer).decode().split('\n')
+        rows.extend(line.split('\t') for line in lines[:count])
+    return rows
+
+__all__ += ['pid_names', 'get_packet', 'get_data',
+            'make_filter', 'packet_view', 'transaction_view',
+            'transaction_order', 'transfer_order',
+            'format_buffer', 'format_rows']
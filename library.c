@@ -1,31 +1,151 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
 #include <arpa/inet.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "library.h"
+#include "stream.h"
+#include "pcap.h"
+
+// Structures shared through library.h are packed, but those private to
+// the decoder need natural alignment, not least for the pthread objects
+// used by the pipeline.
+#pragma pack()
 
 #define MAX_DEVICES 128
 #define MAX_ENDPOINTS 16
 
+// Size of the length prefix before each packet in the raw stream.
+#define LENGTH_SIZE 2
+// Largest packet that can be described by a length prefix.
+#define MAX_PACKET_SIZE 0xFFFF
+// Size of blocks read from input files.
+#define READ_SIZE 0x100000
+// Maximum number of packets in a pipeline batch.
+#define BATCH_PACKETS 16384
+// Size of the buffer for packet bytes in a pipeline batch.
+#define BATCH_DATA_SIZE 0x100000
+// Number of batches circulating in the pipeline.
+#define NUM_BATCHES 4
+// Largest number of packets in a group stored from one checkpoint.
+#define CHECKPOINT_INTERVAL 64
+// Initial and largest sizes of the write buffer for each virtual file.
+#define FILE_BUFFER_MIN 0x1000
+#define FILE_BUFFER_MAX 0x100000
+// Size of the blocks in which payload data is compressed.
+#define DATA_BLOCK_SIZE 0x10000
+// Number of decompressed blocks of payload data cached for each capture.
+#define DATA_CACHE_BLOCKS 8
+// Shortest match with earlier bytes encoded when compressing.
+#define MIN_MATCH 4
+// Number of bits in the hash used to find matches when compressing.
+#define MATCH_HASH_BITS 12
+// Initial number of entries in the table used to find duplicate blocks.
+#define DEDUP_TABLE_MIN 1024
+// Number of packets or transactions in each block summarised for filtering.
+#define SUMMARY_BLOCK 64
+// Number of bitmap words in each block of a filter view's rank index.
+#define RANK_BLOCK_WORDS 8
+// Interval between selected items sampled for a filter view's select index.
+#define SELECT_SAMPLE 512
+// Fewest items worth sorting on more than one thread.
+#define SORT_PARALLEL_MIN 0x10000
+// Generator polynomials of the USB CRCs, bit-reversed.
+#define CRC5_POLY 0x14
+#define CRC16_POLY 0xA001
+// Number of bits covered by the CRC5 of a token or SOF packet.
+#define TOKEN_CRC_BITS 11
+// Number of bits covered by the CRC5 of a split packet.
+#define SPLIT_CRC_BITS 19
+// Number of bytes of payload processed together when computing CRC16.
+#define CRC16_SLICE 8
+// Approximate size of the chunks in which large files are decoded in parallel,
+// and the number of chunks decoded at once. Both may be set when building, as
+// `make check` does to compare parallel and serial decodes of a small file.
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE 0x4000000
+#endif
+#ifndef CHUNK_WORKERS
+#define CHUNK_WORKERS sysconf(_SC_NPROCESSORS_ONLN)
+#endif
+
+// Indexed capture file format.
+//
+// A file begins with a header, followed by a table of sections, one for
+// each array in the capture, in the order listed by capture_arrays().
+// Each section is aligned so that it can be mapped directly as an array.
+// All values are in host byte order.
+#define CAPTURE_MAGIC "LUNACAP"
+#define CAPTURE_VERSION 10
+#define SECTION_ALIGN 0x10000
+// Number of arrays in the capture structure itself.
+#define MAIN_ARRAYS 19
+// Number of arrays for each endpoint.
+#define ENDPOINT_ARRAYS 3
+
+// Size of the buffer used when exporting packets to a file.
+#define EXPORT_BUFFER_SIZE 0x100000
+
+// Most bytes of payload data shown in a table cell.
+#define FORMAT_DATA_MAX 1024
+// Largest size of a formatted table cell other than payload data.
+#define FORMAT_CELL_MAX 32
+
+// Header at the start of an indexed capture file.
+struct file_header {
+	// Magic value identifying the file format.
+	char magic[8];
+	// Version of the file format.
+	uint32_t version;
+	// Number of entries in the section table.
+	uint32_t num_sections;
+};
+
+// Entry in the section table of an indexed capture file.
+struct file_section {
+	// Offset of the section within the file.
+	uint64_t offset;
+	// Length of the section in bytes.
+	uint64_t length;
+	// Size of each item in the section.
+	uint64_t item_size;
+};
+
 // A virtual file used for capture data.
 struct virtual_file {
 	// Filename
 	char *name;
-	// Pointer to count that should be increased when items are written.
-	uint64_t *count_ptr;
 	// Size of an item.
 	size_t item_size;
+	// Number of items written.
+	uint64_t count;
 	// File descriptor.
 	int fd;
-	// Buffered stream.
-	FILE *file;
+	// Buffer for data not yet written to the file.
+	uint8_t *buffer;
+	// Size of the buffer.
+	size_t buffer_size;
+	// Number of bytes held in the buffer.
+	size_t buffered;
+	// Current mapping of the file contents.
+	void *map;
+	// Number of items covered by the current mapping.
+	uint64_t map_count;
+	// Whether any data could not be written to the file or mapped.
+	bool failed;
 };
 
 // Per-endpoint state.
@@ -36,8 +156,14 @@ struct endpoint_state {
 	struct virtual_file transfers;
 	// Output stream for indices of transactions on this endpoint.
 	struct virtual_file transaction_ids;
+	// Output stream for summaries of transfers on this endpoint.
+	struct virtual_file transfer_info;
+	// Summary of the current transfer.
+	struct transfer_info current_info;
 	// Index of this endpoint in the endpoint stream.
 	uint16_t endpoint_id;
+	// Index of the event for the current transfer.
+	uint64_t event_id;
 	// PID that began the last transaction in the current transfer.
 	enum pid last;
 };
@@ -52,6 +178,200 @@ struct transaction_state {
 	uint8_t address;
 	// Endpoint number of the current transaction.
 	uint8_t endpoint_num;
+	// Timestamps of the first and last packets of the current transaction.
+	uint64_t first_ns, last_ns;
+	// PID and payload length of its data packet, if any.
+	uint8_t data_pid;
+	uint16_t data_length;
+	// Request carried by its data packet, if it is a SETUP transaction.
+	struct setup_request setup;
+};
+
+// Record of a transaction, or of a packet outside any transaction, kept
+// when decoding a chunk of a file without decoding transfers.
+struct record {
+	// Whether this is a transaction or a packet.
+	enum event_type type;
+	// The transaction, or for a packet, just its index in first_packet_id.
+	struct transaction transaction;
+	// Transaction decoder state at the end of the transaction.
+	struct transaction_state state;
+};
+
+// Entry in the table of stored blocks of payload data, used to find duplicates.
+struct dedup_entry {
+	// Hash of the block's stored bytes.
+	uint64_t hash;
+	// Location of the block, or all zero if the entry is unused.
+	struct data_block block;
+};
+
+// A decompressed block of payload data held in a cache.
+struct cached_block {
+	// Index of the block.
+	uint64_t index;
+	// Value of the cache's clock when the block was last used, or zero if
+	// this entry is unused.
+	uint64_t last_used;
+	// Decompressed contents of the block.
+	uint8_t data[DATA_BLOCK_SIZE];
+};
+
+// Cache of recently decompressed blocks of payload data.
+struct data_cache {
+	// Counter incremented on each access to the cache.
+	uint64_t clock;
+	// Cached blocks.
+	struct cached_block blocks[DATA_CACHE_BLOCKS];
+};
+
+// Items of a capture selected by a filter.
+//
+// The selection is held as a bitmap, indexed for finding the number of
+// items selected before a given one (rank), and the nth item selected
+// (select).
+struct filter_view {
+	// Number of items in the capture that the view selects from.
+	uint64_t num_items;
+	// Number of items selected.
+	uint64_t count;
+	// Bitmap of the items selected.
+	uint64_t *bits;
+	// Number of words in the bitmap.
+	uint64_t num_words;
+	// Number of items selected before each block of RANK_BLOCK_WORDS words.
+	uint64_t *ranks;
+	// Number of blocks of words.
+	uint64_t num_blocks;
+	// Block containing every SELECT_SAMPLE'th selected item.
+	uint64_t *samples;
+};
+
+// An item to be sorted, with its key.
+struct sort_entry {
+	uint64_t key;
+	uint64_t id;
+};
+
+// Items of a capture in order of a sort key.
+//
+// The order is held as a permutation of item IDs, with the key of each,
+// which is extended as the capture grows by merging in the items added
+// since it was sorted.
+struct sort_index {
+	// Capture whose items are sorted.
+	struct capture *cap;
+	// Whether the items are transfers, rather than transactions.
+	bool transfers;
+	// Key by which the items are sorted.
+	enum sort_key key;
+	// Whether the items were selected by a view, and so are not extended.
+	bool selected;
+	// Window generation of the capture when its items were sorted.
+	uint64_t generation;
+	// Number of items in the capture when its items were sorted.
+	uint64_t num_items;
+	// Items sorted, with their keys, in order.
+	struct sort_entry *entries;
+	// Number of items sorted, and number there is room for.
+	uint64_t count, capacity;
+	// Transfers which may have been in progress when sorted, and whose
+	// keys may have changed since, with their keys when sorted, in
+	// ascending order of ID. There is room for one on each endpoint.
+	struct sort_entry *pending;
+	uint64_t num_pending;
+};
+
+// A range of entries sorted, or merged, on one thread.
+struct sort_part {
+	// Sort index whose key is used.
+	struct sort_index *index;
+	// Entries in the range, and scratch space of the same size.
+	struct sort_entry *entries, *scratch;
+	// Number of entries in the range and, when merging, number in the
+	// first of the two sorted runs making it up.
+	uint64_t count, split;
+	// Thread working on the range, if one could be started.
+	pthread_t thread;
+	bool threaded;
+};
+
+// States of the search for runs of repeated polls.
+enum run_state {
+	// Last packet could not begin a poll.
+	RUN_IDLE,
+	// Last packet was an IN token, which may begin a poll.
+	RUN_TOKEN,
+	// Last packets were a poll, which may be repeated.
+	RUN_POLL,
+	// Last packet repeated the token of the poll, and was held back.
+	RUN_HELD,
+};
+
+// Effect of a packet on the search for runs of repeated polls.
+enum run_status {
+	// Packet is decoded as usual.
+	RUN_NONE,
+	// Packet is part of a repeated poll, and is not decoded.
+	RUN_ABSORBED,
+	// Packet is decoded as usual, after the token held back.
+	RUN_RELEASED,
+};
+
+// Header stored before each packet in a rolling window.
+struct window_header {
+	// Time at which the packet was received.
+	uint64_t timestamp_ns;
+	// Length of the packet.
+	uint16_t length;
+};
+
+// Rolling window of the most recent packets received.
+//
+// The capture is decoded from packets as they arrive, and rebuilt from
+// those in the window once it holds twice the window's size or time span.
+// The rebuild runs on a thread of its own while decoding continues, and
+// the rebuilt capture replaces the current one once it has caught up.
+struct window {
+	// Largest number of bytes of packets retained, including headers.
+	uint64_t max_bytes;
+	// Longest time span of packets retained, or zero for no limit.
+	uint64_t max_ns;
+	// Size of the circular buffer, which may exceed the window to hold
+	// packets received while a rebuild has yet to decode older ones.
+	uint64_t capacity;
+	// Positions of the oldest packet retained and of the next to be
+	// added, counting bytes added since the start of the stream.
+	uint64_t head, tail;
+	// Number of bytes of packets decoded since the capture was rebuilt.
+	uint64_t decoded;
+	// Timestamp of the first packet decoded since the capture was rebuilt.
+	uint64_t start_ns;
+	// Rebuild of the capture in progress, or NULL if none.
+	struct rebuild *rebuild;
+	// Buffer for a packet taken from the window.
+	uint8_t packet[MAX_PACKET_SIZE];
+	// Circular buffer of packets, each preceded by a header.
+	uint8_t buffer[];
+};
+
+// State of a decoder in trigger mode.
+struct trigger_state {
+	// Conditions on which the trigger fires.
+	struct trigger conditions;
+	// Recent packets held back, from which those before a hit are decoded.
+	struct window *held;
+	// Position in the window following the last packet decoded.
+	uint64_t decoded;
+	// Whether the trigger has fired, and time up to which packets are kept.
+	bool fired;
+	uint64_t keep_until_ns;
+	// PID, address and endpoint of the last token, or zero PID if none.
+	uint8_t token_pid, token_address, token_endpoint;
+	// Whether the last packet was a SETUP token.
+	bool setup;
+	// Timestamp of the last packet received, or zero if none.
+	uint64_t last_ns;
 };
 
 // Context structure for shared variables needed during decoding.
@@ -59,7 +379,55 @@ struct context {
 	// Capture which we are decoding.
 	struct capture *capture;
 	// Main output streams.
-	struct virtual_file events, packets, transactions, endpoints, transfer_index, data;
+	struct virtual_file events, transactions, endpoints, transfer_index, data;
+	// Output streams for the events containing each transaction and transfer.
+	struct virtual_file transaction_events, transfer_events;
+	// Output stream for summaries of transactions.
+	struct virtual_file transaction_info;
+	// Output streams for summaries of blocks of packets and transactions.
+	struct virtual_file packet_summaries, transaction_summaries;
+	// Summaries of the current blocks of packets and transactions.
+	uint16_t packet_summary;
+	struct filter transaction_summary;
+	// Output stream for the bitmap of packets failing their CRC check.
+	struct virtual_file packet_crc_errors;
+	// Bits of the current word of the bitmap of CRC errors.
+	uint64_t packet_crc_error_word;
+	// Whether runs of repeated polls are collapsed.
+	bool runs;
+	// Output stream for runs of repeated polls.
+	struct virtual_file poll_runs;
+	// Output stream for packets which fired a trigger.
+	struct virtual_file trigger_hits;
+	// Current run of repeated polls, and state of the search for one.
+	struct poll_run run;
+	enum run_state run_state;
+	// Token of the poll which may be repeated.
+	uint8_t run_token[3];
+	// Repeat of the token held back, if any, and its timestamp.
+	uint8_t run_held[3];
+	uint64_t run_held_ns;
+	// Output streams for packet columns.
+	struct virtual_file packet_pids, packet_lengths, packet_fields,
+		packet_time_offsets, packet_checkpoints;
+	// Checkpoint for the current group of packets written.
+	struct packet_checkpoint checkpoint;
+	// Total size of payload data written.
+	uint64_t data_size;
+	// Whether payload data is compressed.
+	bool compressed;
+	// Output stream for locations of compressed blocks of payload data.
+	struct virtual_file data_blocks;
+	// Payload data not yet compressed.
+	uint8_t *data_pending;
+	// Number of bytes of payload data not yet compressed.
+	size_t data_pending_size;
+	// Buffers for compressing a block, and for reading back a stored one.
+	uint8_t *data_compressed, *data_readback;
+	// Hash table of stored blocks, used to find duplicates.
+	struct dedup_entry *dedup_table;
+	// Number of entries in the hash table, and number used.
+	size_t dedup_size, dedup_used;
 	// Array of pointers to to per-endpoint states.
 	struct endpoint_state *endpoint_states[MAX_DEVICES][MAX_ENDPOINTS];
 	// Transaction decoder state.
@@ -68,13 +436,166 @@ struct context {
 	struct transaction current_transaction;
 	// The current packet on the bus.
 	struct packet current_packet;
+	// Bytes of the current packet on the wire, or NULL if not kept.
+	const uint8_t *packet_bytes;
+	// Index of the current packet.
+	uint64_t packet_id;
+	// Whether transactions are recorded, rather than decoded into transfers.
+	bool deferred;
+	// Records of transactions and packets, if deferred.
+	struct virtual_file records;
+	// Whether data was lost other than in writing a file, such as a chunk
+	// which could not be decoded.
+	bool failed;
+};
+
+// Formats of input stream.
+enum stream_format {
+	// Format not yet identified.
+	FORMAT_UNKNOWN,
+	// Raw LUNA packet stream, without timestamps.
+	FORMAT_RAW,
+	// Timestamped stream, as described in stream.h.
+	FORMAT_TIMESTAMPED,
+};
+
+// Incremental decoder state.
+struct decoder {
+	// Decoding context.
+	struct context context;
+	// Format of the input stream.
+	enum stream_format format;
+	// Storage for a stream or block header split between calls to decoder_feed().
+	uint8_t header[sizeof(struct block_header)];
+	// Number of bytes held of a split header.
+	size_t header_pending;
+	// Number of bytes of stream magic still to be skipped.
+	size_t skip;
+	// Header of the current block, in host byte order.
+	struct block_header block;
+	// Offset within the current block of the next byte of data.
+	uint64_t block_offset;
+	// Number of bytes held of a packet split between calls to decoder_feed().
+	size_t pending;
+	// Storage for a split packet, including its length prefix.
+	uint8_t partial[LENGTH_SIZE + MAX_PACKET_SIZE];
+	// Timestamp of the split packet.
+	uint64_t partial_timestamp;
+	// Buffer used by decoder_read().
+	uint8_t *read_buffer;
+	// Decoding pipeline, or NULL if decoding on the calling thread.
+	struct pipeline *pipeline;
+	// Options the decoder was opened with.
+	unsigned int flags;
+	// Rolling window of recent packets, or NULL if all are kept.
+	struct window *window;
+	// Trigger state, or NULL if not in trigger mode.
+	struct trigger_state *trigger;
+};
+
+// Location of a packet's bytes within a batch.
+struct packet_location {
+	// Time at which the packet was received.
+	uint64_t timestamp_ns;
+	// Offset of the packet within the batch data.
+	uint32_t offset;
+	// Length of the packet.
+	uint16_t length;
+};
+
+// A batch of consecutive packets passed between pipeline stages.
+struct batch {
+	// Next batch in the queue holding this one.
+	struct batch *next;
+	// Number of packets in the batch.
+	uint32_t num_packets;
+	// Number of bytes used in the data buffer.
+	uint32_t data_used;
+	// Index of the first packet in the batch.
+	uint64_t first_packet_id;
+	// Where each packet's bytes are in the data buffer.
+	struct packet_location locations[BATCH_PACKETS];
+	// Packets as parsed from their bytes.
+	struct packet packets[BATCH_PACKETS];
+	// Bytes of each packet parsed, or NULL for a token released from a
+	// run of polls, whose bytes are not kept.
+	const uint8_t *bytes[BATCH_PACKETS];
+	// Packet bytes, back to back.
+	uint8_t data[BATCH_DATA_SIZE];
+};
+
+// A queue of batches waiting for a pipeline stage.
+struct batch_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	// First and last batches in the queue.
+	struct batch *head, *tail;
+	// Number of batches in the queue.
+	int count;
+	// Set when no more batches will be added.
+	bool stopped;
+};
+
+// Decoding pipeline.
+//
+// Batches are filled with framed packets by the thread calling
+// decoder_feed(), parsed into packets by the parse thread, and run
+// through the transaction and transfer state machines by the state
+// thread, before returning to the free queue to be filled again.
+struct pipeline {
+	// Queues of batches for each stage.
+	struct batch_queue free, parse, state;
+	// Batch currently being filled, if any.
+	struct batch *current;
+	// Threads for the parse and state stages.
+	pthread_t parse_thread, state_thread;
+	// All batches, for freeing.
+	struct batch *batches[NUM_BATCHES];
+};
+
+// Number of bytes of packets between exchanges of positions in a window
+// with the thread rebuilding a capture from it.
+#define REBUILD_STEP 0x10000
+
+// Capture being rebuilt from a rolling window.
+struct rebuild {
+	// Window from which the capture is rebuilt.
+	struct window *window;
+	// Context for decoding the new capture, and the capture itself.
+	struct context context;
+	struct capture *capture;
+	// Timestamp of the newest packet when the rebuild started.
+	uint64_t newest_ns;
+	// Position and timestamp of the first packet decoded.
+	uint64_t start, start_ns;
+	// Position up to which the thread feeding the decoder may discard
+	// packets, as of the last exchange.
+	uint64_t evictable;
+	// Thread for the rebuild, if one could be started.
+	pthread_t thread;
+	bool threaded;
+	// Lock and condition protecting the fields below.
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	// Positions up to which packets have been added and decoded.
+	uint64_t tail, decoded;
+	// Whether the rebuild has caught up, and whether it should stop.
+	bool done, stop;
+	// Whether the thread feeding the decoder is waiting for room.
+	bool waiting;
+	// Buffer for a packet taken from the window.
+	uint8_t packet[MAX_PACKET_SIZE];
 };
 
 // Open a virtual file for open-ended capture data.
 static inline void file_open(struct virtual_file *file)
 {
 	file->fd = memfd_create(file->name, 0);
-	file->file = fdopen(file->fd, "r+");
+	file->failed = (file->fd < 0);
+	// Buffer is allocated on first write.
+	file->buffer = NULL;
+	file->buffer_size = 0;
+	file->buffered = 0;
 }
 
 // Create a new virtual file with a name in the format 'foo_0'.
@@ -82,11 +603,12 @@ static inline void file_create(
 	struct virtual_file *file,
 	const char *name,
 	uint16_t index,
-	uint64_t *count_ptr,
 	size_t item_size)
 {
-	file->count_ptr = count_ptr;
 	file->item_size = item_size;
+	file->count = 0;
+	file->map = NULL;
+	file->map_count = 0;
 	// Construct and set filename.
 	const char *name_fmt = "%s_%u";
 	size_t name_len = snprintf(NULL, 0, name_fmt, name, index) + 1;
@@ -96,26 +618,393 @@ static inline void file_create(
 	file_open(file);
 }
 
+// Write all of a block of data to a file descriptor.
+//
+// Returns false if it could not all be written.
+static bool write_all(int fd, const void *src, size_t length)
+{
+	const uint8_t *data = src;
+	while (length > 0) {
+		ssize_t count = write(fd, data, length);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return false;
+		data += count;
+		length -= count;
+	}
+	return true;
+}
+
+// Write out any data held in a virtual file's buffer.
+static inline void file_flush(struct virtual_file *file)
+{
+	if (file->buffered > 0) {
+		if (!write_all(file->fd, file->buffer, file->buffered))
+			file->failed = true;
+		file->buffered = 0;
+	}
+}
+
+// Write data which does not fit in a virtual file's buffer.
+//
+// The buffer is flushed and grown, so files written often get larger
+// buffers, then the data is either buffered or, if still too large,
+// written directly.
+static void file_write_slow(struct virtual_file *file, const void *src, size_t length)
+{
+	file_flush(file);
+
+	if (file->buffer_size < FILE_BUFFER_MAX) {
+		file->buffer_size = file->buffer_size ? file->buffer_size * 2 : FILE_BUFFER_MIN;
+		free(file->buffer);
+		file->buffer = malloc(file->buffer_size);
+		// Without a buffer, write directly until one can be allocated.
+		if (!file->buffer)
+			file->buffer_size = 0;
+	}
+
+	if (file->buffer && length <= file->buffer_size) {
+		memcpy(file->buffer, src, length);
+		file->buffered = length;
+	} else if (!write_all(file->fd, src, length)) {
+		file->failed = true;
+	}
+}
+
 // Write items to virtual file.
 static inline void file_write(struct virtual_file *file, void *src, uint64_t num_items)
 {
-	fwrite(src, num_items, file->item_size, file->file);
-	*file->count_ptr += num_items;
+	size_t length = num_items * file->item_size;
+
+	// Append to the buffer if there is space.
+	if (length <= file->buffer_size - file->buffered) {
+		memcpy(&file->buffer[file->buffered], src, length);
+		file->buffered += length;
+	} else {
+		file_write_slow(file, src, length);
+	}
+
+	file->count += num_items;
+}
+
+// Write an item just past the end of a virtual file, without counting it.
+//
+// The item will be overwritten by the next call to file_write().
+static inline void file_write_provisional(struct virtual_file *file, void *src)
+{
+	file_flush(file);
+	if (pwrite(file->fd, src, file->item_size, file->count * file->item_size)
+			!= file->item_size)
+		file->failed = true;
 }
 
-// Map completed virtual file into address space.
-static inline void * file_map(struct virtual_file *file)
+// Map the first num_items items of a virtual file into address space.
+//
+// Any previous mapping of the file is extended or moved as required.
+static inline void * file_map(struct virtual_file *file, uint64_t num_items)
 {
 	// Flush buffered writes.
-	fflush(file->file);
-	// Calculate mapping size.
-	size_t map_length = *file->count_ptr * file->item_size;
-	// Create mapping.
-	void *map = mmap(NULL, map_length, PROT_READ, MAP_SHARED, file->fd, 0);
-	// Close file.
-	fclose(file->file);
+	file_flush(file);
+	// Nothing to do if the mapping size is unchanged.
+	if (num_items == file->map_count)
+		return file->map;
+	// Calculate mapping sizes.
+	size_t old_length = file->map_count * file->item_size;
+	size_t new_length = num_items * file->item_size;
+	// Create or resize mapping.
+	void *map;
+	if (old_length == 0)
+		map = mmap(NULL, new_length, PROT_READ, MAP_SHARED, file->fd, 0);
+	else
+		map = mremap(file->map, old_length, new_length, MREMAP_MAYMOVE);
+	// Keep any previous mapping if the file cannot be mapped.
+	if (map == MAP_FAILED) {
+		file->failed = true;
+		return file->map;
+	}
+	file->map = map;
+	file->map_count = num_items;
 	// Return mapping.
-	return map;
+	return file->map;
+}
+
+// Close virtual file. Any mapping remains valid.
+static inline void file_close(struct virtual_file *file)
+{
+	file_flush(file);
+	free(file->buffer);
+	close(file->fd);
+}
+
+// Write the extension of a length field in compressed data.
+//
+// Lengths of 15 or more are continued in following bytes, each of which
+// is added to the length, until one is less than 255.
+static inline uint8_t *length_write(uint8_t *out, size_t length)
+{
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+	return out;
+}
+
+// Read the extension of a length field in compressed data, if it has one.
+static inline bool length_read(const uint8_t **in, const uint8_t *end, size_t *length)
+{
+	uint8_t byte = 255;
+	if (*length != 15)
+		return true;
+	while (byte == 255) {
+		if (*in == end)
+			return false;
+		byte = *(*in)++;
+		*length += byte;
+	}
+	return true;
+}
+
+// Write a sequence of compressed data: a token byte holding the lengths of
+// a run of literal bytes and of the following match, any extensions to
+// those lengths, the literal bytes, and the offset of the match back from
+// the current position. The last sequence has literals only.
+//
+// Returns NULL if the sequence would not fit before the limit.
+static inline uint8_t *sequence_write(uint8_t *out, uint8_t *limit,
+	const uint8_t *literals, size_t num_literals, size_t offset, size_t match_length)
+{
+	size_t match_code = match_length ? match_length - MIN_MATCH : 0;
+
+	// Allow for the token, offset, and the longest length extensions.
+	if (num_literals + num_literals / 255 + match_code / 255 + 5 > limit - out)
+		return NULL;
+
+	*out++ = (num_literals < 15 ? num_literals : 15) << 4
+		| (match_code < 15 ? match_code : 15);
+	if (num_literals >= 15)
+		out = length_write(out, num_literals - 15);
+	memcpy(out, literals, num_literals);
+	out += num_literals;
+
+	if (match_length) {
+		*out++ = offset & 0xFF;
+		*out++ = offset >> 8;
+		if (match_code >= 15)
+			out = length_write(out, match_code - 15);
+	}
+
+	return out;
+}
+
+// Compress a block of payload data, as a series of literal runs, each
+// followed by a match with earlier bytes in the block.
+//
+// Returns the compressed length, or zero if the data cannot be compressed
+// to less than its original length.
+static size_t block_compress(const uint8_t *src, size_t length, uint8_t *dest)
+{
+	// Most recent position at which each hash of MIN_MATCH bytes was seen.
+	uint16_t table[1 << MATCH_HASH_BITS];
+	uint8_t *out = dest, *limit = dest + length;
+	size_t pos = 0, anchor = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (pos + MIN_MATCH <= length)
+	{
+		uint32_t sequence;
+		memcpy(&sequence, &src[pos], MIN_MATCH);
+		uint32_t hash = (sequence * 2654435761U) >> (32 - MATCH_HASH_BITS);
+		size_t candidate = table[hash];
+		table[hash] = pos;
+
+		if (candidate >= pos || memcmp(&src[candidate], &src[pos], MIN_MATCH) != 0) {
+			// No match. Step faster through data that is not compressing.
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+
+		// Extend the match as far as it goes.
+		size_t match_length = MIN_MATCH;
+		while (pos + match_length < length
+				&& src[candidate + match_length] == src[pos + match_length])
+			match_length++;
+
+		out = sequence_write(out, limit, &src[anchor], pos - anchor,
+			pos - candidate, match_length);
+		if (!out)
+			return 0;
+
+		pos += match_length;
+		anchor = pos;
+	}
+
+	// Finish with any remaining literals.
+	out = sequence_write(out, limit, &src[anchor], length - anchor, 0, 0);
+
+	return out ? out - dest : 0;
+}
+
+// Decompress a block of payload data.
+//
+// Returns false if the compressed data is invalid, or does not decompress
+// to exactly the given length.
+static bool block_decompress(const uint8_t *src, size_t stored_length,
+	uint8_t *dest, size_t length)
+{
+	const uint8_t *in = src, *end = src + stored_length;
+	size_t out = 0;
+
+	while (in < end)
+	{
+		uint8_t token = *in++;
+
+		// Copy literals.
+		size_t num_literals = token >> 4;
+		if (!length_read(&in, end, &num_literals)
+				|| num_literals > end - in || num_literals > length - out)
+			return false;
+		memcpy(&dest[out], in, num_literals);
+		in += num_literals;
+		out += num_literals;
+
+		// The last sequence has no match.
+		if (in == end)
+			break;
+
+		// Copy match, which may overlap the bytes being written.
+		if (end - in < 2)
+			return false;
+		size_t offset = in[0] | in[1] << 8;
+		in += 2;
+		size_t match_length = token & 0x0F;
+		if (!length_read(&in, end, &match_length))
+			return false;
+		match_length += MIN_MATCH;
+		if (offset == 0 || offset > out || match_length > length - out)
+			return false;
+		for (size_t i = 0; i < match_length; i++, out++)
+			dest[out] = dest[out - offset];
+	}
+
+	return out == length;
+}
+
+// Hash of a block's stored bytes, for finding duplicates.
+static inline uint64_t block_hash(const uint8_t *data, size_t length)
+{
+	uint64_t hash = length;
+	size_t i;
+	for (i = 0; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, &data[i], 8);
+		hash = (hash ^ word) * 0x100000001B3ULL;
+		hash ^= hash >> 29;
+	}
+	for (; i < length; i++)
+		hash = (hash ^ data[i]) * 0x100000001B3ULL;
+	return hash;
+}
+
+// Grow the table of stored blocks, rehashing its entries.
+static void dedup_grow(struct context *context)
+{
+	struct dedup_entry *old_table = context->dedup_table;
+	size_t old_size = context->dedup_size;
+
+	context->dedup_size = old_size ? old_size * 2 : DEDUP_TABLE_MIN;
+	context->dedup_table = calloc(context->dedup_size, sizeof(struct dedup_entry));
+
+	for (size_t i = 0; i < old_size; i++) {
+		struct dedup_entry *old = &old_table[i];
+		if (old->block.length == 0)
+			continue;
+		size_t j = old->hash & (context->dedup_size - 1);
+		while (context->dedup_table[j].block.length != 0)
+			j = (j + 1) & (context->dedup_size - 1);
+		context->dedup_table[j] = *old;
+	}
+
+	free(old_table);
+}
+
+// Compress and store the pending block of payload data.
+//
+// If identical bytes have already been stored for an earlier block, the
+// new block refers to those rather than storing them again.
+static void data_block_store(struct context *context)
+{
+	struct data_block block;
+	const uint8_t *stored = context->data_compressed;
+
+	block.length = context->data_pending_size;
+	block.stored_length = block_compress(context->data_pending, block.length,
+		context->data_compressed);
+	if (block.stored_length == 0) {
+		stored = context->data_pending;
+		block.stored_length = block.length;
+	}
+
+	// Keep the table of stored blocks at most half full.
+	if (2 * (context->dedup_used + 1) > context->dedup_size)
+		dedup_grow(context);
+
+	// Look for an identical block, checking the bytes of any with a
+	// matching hash.
+	uint64_t hash = block_hash(stored, block.stored_length);
+	size_t i = hash & (context->dedup_size - 1);
+	struct dedup_entry *entry;
+	while ((entry = &context->dedup_table[i])->block.length != 0)
+	{
+		if (entry->hash == hash
+				&& entry->block.length == block.length
+				&& entry->block.stored_length == block.stored_length) {
+			file_flush(&context->data);
+			if (pread(context->data.fd, context->data_readback, block.stored_length,
+					entry->block.offset) == block.stored_length
+					&& memcmp(context->data_readback, stored, block.stored_length) == 0) {
+				file_write(&context->data_blocks, &entry->block, 1);
+				context->data_pending_size = 0;
+				return;
+			}
+		}
+		i = (i + 1) & (context->dedup_size - 1);
+	}
+
+	// Store the new block.
+	block.offset = context->data.count;
+	file_write(&context->data, (void *) stored, block.stored_length);
+	file_write(&context->data_blocks, &block, 1);
+	entry->hash = hash;
+	entry->block = block;
+	context->dedup_used++;
+	context->data_pending_size = 0;
+}
+
+// Write payload data, compressing it in blocks if required.
+static inline void data_write(struct context *context, const uint8_t *src, size_t length)
+{
+	context->data_size += length;
+
+	if (!context->compressed) {
+		file_write(&context->data, (void *) src, length);
+		return;
+	}
+
+	while (length > 0)
+	{
+		size_t count = DATA_BLOCK_SIZE - context->data_pending_size;
+		if (count > length)
+			count = length;
+		memcpy(&context->data_pending[context->data_pending_size], src, count);
+		context->data_pending_size += count;
+		src += count;
+		length -= count;
+		if (context->data_pending_size == DATA_BLOCK_SIZE)
+			data_block_store(context);
+	}
 }
 
 // Time as nanoseconds since Unix epoch (good for next 500 years).
@@ -126,25 +1015,32 @@ static inline uint64_t nanotime(void)
 	return ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-// Create an event in the timeline.
-static inline void event_create(struct context *context, enum event_type type)
+// Create an event in the timeline, returning its index.
+static inline uint64_t event_create(struct context *context, enum event_type type)
 {
-	struct capture *cap = context->capture;
 	struct event evt;
 	evt.type = type;
 	switch (type)
 	{
 		case PACKET:
-			evt.id = cap->num_packets;
+			evt.id = context->packet_id;
 			break;
 		case TRANSACTION:
-			evt.id = cap->num_transactions;
+			evt.id = context->transactions.count;
 			break;
 		case TRANSFER:
-			evt.id = cap->num_transfers;
+			evt.id = context->transfer_index.count;
 			break;
 	}
 	file_write(&context->events, &evt, 1);
+	return context->events.count - 1;
+}
+
+// Create an event for a transaction outside any transfer.
+static inline void transaction_event_create(struct context *context)
+{
+	uint64_t event_id = event_create(context, TRANSACTION);
+	file_write(&context->transaction_events, &event_id, 1);
 }
 
 // Get endpoint state for current transaction.
@@ -163,7 +1059,7 @@ static inline struct endpoint_state *endpoint_state(struct context *context)
 	context->endpoint_states[address][endpoint_num] = ep_state;
 
 	// Initialise endpoint state.
-	uint16_t endpoint_id = ep_state->endpoint_id = cap->num_endpoints;
+	uint16_t endpoint_id = ep_state->endpoint_id = context->endpoints.count;
 	ep_state->current_transfer.num_transactions = 0;
 	ep_state->last = 0;
 
@@ -174,22 +1070,21 @@ static inline struct endpoint_state *endpoint_state(struct context *context)
 	// Reallocate endpoint traffic pointer array to add an entry.
 	size_t entry_size = sizeof(struct endpoint_traffic);
 	size_t ptr_size = sizeof(struct endpoint_traffic *);
-	size_t new_size = cap->num_endpoints * ptr_size;
+	size_t new_size = context->endpoints.count * ptr_size;
 	cap->endpoint_traffic = realloc(cap->endpoint_traffic, new_size);
 	cap->endpoint_traffic[endpoint_id] = malloc(entry_size);
 	struct endpoint_traffic *ep_traf = cap->endpoint_traffic[endpoint_id];
 
 	// Initialise endpoint traffic data.
-	ep_traf->num_transfers = 0;
-	ep_traf->num_transaction_ids = 0;
+	memset(ep_traf, 0, entry_size);
 
 	// Set up files for endpoint traffic data.
 	file_create(&ep_state->transfers,
-		"transfers", endpoint_id,
-		&ep_traf->num_transfers, sizeof(struct transfer));
+		"transfers", endpoint_id, sizeof(struct transfer));
 	file_create(&ep_state->transaction_ids,
-		"transaction_ids", endpoint_id,
-		&ep_traf->num_transaction_ids, sizeof(uint64_t));
+		"transaction_ids", endpoint_id, sizeof(uint64_t));
+	file_create(&ep_state->transfer_info,
+		"transfer_info", endpoint_id, sizeof(struct transfer_info));
 
 	return ep_state;
 }
@@ -206,9 +1101,17 @@ enum transfer_status {
 	TRANSFER_INVALID,
 };
 
+// Index of each PID byte in the state tables: the PID's low nibble if its
+// check bits are valid, or zero otherwise. No rule accepts an invalid PID,
+// nor RSVD which shares its index, so these are treated alike.
+static uint8_t pid_index[256];
+
 // Get transfer status based on next transaction for its endpoint.
-static inline enum transfer_status
-transfer_status(bool control, enum pid last, enum pid next)
+//
+// This is the specification from which transfer_table is built, and is
+// not used directly while decoding.
+static enum transfer_status
+transfer_rule(bool control, enum pid last, enum pid next)
 {
 	// A SETUP transaction on a control endpoint always starts
 	// a new control transfer.
@@ -283,6 +1186,16 @@ transfer_status(bool control, enum pid last, enum pid next)
 	return TRANSFER_INVALID;
 }
 
+// Transfer status for each endpoint type and indices of last and next PIDs.
+static uint8_t transfer_table[2][16][16];
+
+// Get transfer status based on next transaction for its endpoint.
+static inline enum transfer_status
+transfer_status(bool control, enum pid last, enum pid next)
+{
+	return transfer_table[control][pid_index[last]][pid_index[next]];
+}
+
 // Append a transaction to the current transfer.
 static inline void transfer_append(struct context *context, bool success)
 {
@@ -291,33 +1204,50 @@ static inline void transfer_append(struct context *context, bool success)
 	struct endpoint_state *ep_state = context->endpoint_states[address][endpoint_num];
 	struct transfer *xfer = &ep_state->current_transfer;
 
-	uint64_t tran_idx = context->capture->num_transactions;
+	struct transaction_state *state = &context->transaction_state;
+	struct transfer_info *info = &ep_state->current_info;
+
+	uint64_t tran_idx = context->transactions.count;
 	file_write(&ep_state->transaction_ids, &tran_idx, 1);
+	file_write(&context->transaction_events, &ep_state->event_id, 1);
 	xfer->num_transactions++;
 	if (success)
-		ep_state->last = context->transaction_state.first;
+		ep_state->last = state->first;
+
+	// Update the transfer's summary.
+	info->duration_ns = state->last_ns - info->timestamp_ns;
+	if (state->first != SETUP && state->last == ACK)
+		info->data_length += state->data_length;
 }
 
 // Start a new transfer with the current transaction.
 static inline void transfer_start(struct context *context)
 {
-	struct capture *cap = context->capture;
 	uint8_t address = context->transaction_state.address;
 	uint8_t endpoint_num = context->transaction_state.endpoint_num;
 	struct endpoint_state *ep_state = context->endpoint_states[address][endpoint_num];
-	struct endpoint_traffic *ep_traf = cap->endpoint_traffic[ep_state->endpoint_id];
 	struct transfer *xfer = &ep_state->current_transfer;
 
 	// Write out a transfer index entry.
 	struct transfer_index_entry entry = {
 		.endpoint_id = ep_state->endpoint_id,
-		.transfer_id = ep_traf->num_transfers,
+		.transfer_id = ep_state->transfers.count,
 	};
 	file_write(&context->transfer_index, &entry, 1);
+	file_write(&context->transfer_events, &ep_state->event_id, 1);
 
 	// Transaction is first of the new transfer.
-	xfer->ep_tran_offset = ep_traf->num_transaction_ids;
+	xfer->ep_tran_offset = ep_state->transaction_ids.count;
 	xfer->num_transactions = 0;
+
+	// Start the transfer's summary, with its request if a control transfer.
+	struct transaction_state *state = &context->transaction_state;
+	struct transfer_info *info = &ep_state->current_info;
+	memset(info, 0, sizeof(struct transfer_info));
+	info->timestamp_ns = state->first_ns;
+	if (state->first == SETUP)
+		info->setup = state->setup;
+
 	transfer_append(context, true);
 }
 
@@ -329,6 +1259,7 @@ static inline void transfer_end(struct context *context, struct endpoint_state *
 		// A transfer was in progress, write it out.
 		xfer->complete = complete;
 		file_write(&ep_state->transfers, xfer, 1);
+		file_write(&ep_state->transfer_info, &ep_state->current_info, 1);
 	}
 
 	// No transfer is now in progress.
@@ -346,7 +1277,7 @@ static inline void transfer_update(struct context *context)
 	// is placed in the top level event stream directly rather
 	// than being assigned to a transfer.
 	if (transaction_type == SOF) {
-		event_create(context, TRANSACTION);
+		transaction_event_create(context);
 		return;
 	}
 
@@ -380,7 +1311,7 @@ static inline void transfer_update(struct context *context)
 	case TRANSFER_NEW:
 		// New transfer. End any previous one as incomplete.
 		transfer_end(context, ep_state, false);
-		event_create(context, TRANSFER);
+		ep_state->event_id = event_create(context, TRANSFER);
 		transfer_start(context);
 		break;
 	case TRANSFER_CONT:
@@ -395,7 +1326,7 @@ static inline void transfer_update(struct context *context)
 	case TRANSFER_INVALID:
 		// Transaction not valid as part of any current transfer.
 		transfer_end(context, ep_state, false);
-		event_create(context, TRANSACTION);
+		transaction_event_create(context);
 		break;
 	}
 }
@@ -413,8 +1344,11 @@ enum transaction_status {
 };
 
 // Get transaction status based on next packet
-static inline enum transaction_status
-transaction_status(enum pid first, enum pid last, enum pid next)
+//
+// This is the specification from which transaction_table is built, and is
+// not used directly while decoding.
+static enum transaction_status
+transaction_rule(enum pid first, enum pid last, enum pid next)
 {
 	// SETUP, IN and OUT always start a new transaction.
 	switch (next)
@@ -514,6 +1448,45 @@ transaction_status(enum pid first, enum pid last, enum pid next)
 	return TRANSACTION_INVALID;
 }
 
+// Transaction status for each index of first, last and next PIDs.
+static uint8_t transaction_table[16][16][16];
+
+// Get transaction status based on next packet
+static inline enum transaction_status
+transaction_status(enum pid first, enum pid last, enum pid next)
+{
+	return transaction_table[pid_index[first]][pid_index[last]][pid_index[next]];
+}
+
+// Build the state tables from the rules above.
+static void state_tables_init(void)
+{
+	for (int byte = 0; byte < 256; byte++)
+		pid_index[byte] = ((byte >> 4) ^ (byte & PID_MASK)) == PID_MASK ?
+			byte & PID_MASK : 0;
+
+	// PID with each index. The first and last PIDs of a transfer or
+	// transaction use index zero for NONE, when there are none yet;
+	// they are only ever set to PIDs accepted by a rule, never RSVD.
+	enum pid pids[16], states[16];
+	for (int i = 0; i < 16; i++) {
+		pids[i] = (~i << 4 & 0xF0) | i;
+		states[i] = i ? pids[i] : NONE;
+	}
+
+	for (int control = 0; control < 2; control++)
+		for (int last = 0; last < 16; last++)
+			for (int next = 0; next < 16; next++)
+				transfer_table[control][last][next] =
+					transfer_rule(control, states[last], pids[next]);
+
+	for (int first = 0; first < 16; first++)
+		for (int last = 0; last < 16; last++)
+			for (int next = 0; next < 16; next++)
+				transaction_table[first][last][next] =
+					transaction_rule(states[first], states[last], pids[next]);
+}
+
 // Start a new transaction with the current packet.
 static inline void transaction_start(struct context *context)
 {
@@ -521,7 +1494,7 @@ static inline void transaction_start(struct context *context)
 	struct transaction *tran = &context->current_transaction;
 	struct packet *pkt = &context->current_packet;
 
-	tran->first_packet_id = context->capture->num_packets;
+	tran->first_packet_id = context->packet_id;
 	tran->num_packets = 1;
 	state->first = pkt->pid;
 	state->last = pkt->pid;
@@ -529,6 +1502,12 @@ static inline void transaction_start(struct context *context)
 		state->address = pkt->fields.token.address;
 		state->endpoint_num = pkt->fields.token.endpoint_num;
 	};
+	state->first_ns = pkt->timestamp_ns;
+	state->last_ns = pkt->timestamp_ns;
+	state->data_pid = 0;
+	state->data_length = 0;
+	if (pkt->pid == SETUP)
+		memset(&state->setup, 0, sizeof(struct setup_request));
 }
 
 // Append packet to the current transaction.
@@ -540,6 +1519,78 @@ static inline void transaction_append(struct context *context)
 
 	tran->num_packets++;
 	state->last = pkt->pid;
+	state->last_ns = pkt->timestamp_ns;
+
+	// Note the data packet, and the request it carries in a SETUP transaction.
+	if ((pkt->pid & PID_TYPE_MASK) == DATA) {
+		const uint8_t *buf = context->packet_bytes;
+		state->data_pid = pkt->pid;
+		state->data_length = pkt->length > 3 ? pkt->length - 3 : 0;
+		if (state->first == SETUP && buf
+				&& state->data_length >= sizeof(struct setup_request)) {
+			memcpy(&state->setup, &buf[1], sizeof(struct setup_request));
+			state->setup.value = le16toh(state->setup.value);
+			state->setup.index = le16toh(state->setup.index);
+			state->setup.length = le16toh(state->setup.length);
+		}
+	}
+}
+
+// Add a transaction to the summary of the current block of transactions,
+// writing out the summary when the block is complete.
+static inline void transaction_summarize(struct context *context)
+{
+	struct transaction_state *state = &context->transaction_state;
+	struct filter *summary = &context->transaction_summary;
+
+	summary->pids |= 1 << (state->first & PID_MASK);
+	summary->results |= 1 << (state->last & PID_MASK);
+	if (state->first != SOF) {
+		summary->addresses[state->address / 64] |= 1ULL << (state->address % 64);
+		summary->endpoints |= 1 << state->endpoint_num;
+	}
+
+	if (context->transactions.count % SUMMARY_BLOCK == 0) {
+		file_write(&context->transaction_summaries, summary, 1);
+		memset(summary, 0, sizeof(struct filter));
+	}
+}
+
+// Decode a completed transaction into transfers, and write it out.
+static inline void transaction_commit(struct context *context)
+{
+	// Update transfer state.
+	transfer_update(context);
+	// Write out transaction, and its summary.
+	struct transaction_state *state = &context->transaction_state;
+	struct transaction_info info = {
+		.timestamp_ns = state->first_ns,
+		.duration_ns = state->last_ns - state->first_ns,
+		.data_length = state->data_length,
+		.type = state->first,
+		.result = state->last,
+		.data_pid = state->data_pid,
+		.address = state->first == SOF ? 0 : state->address,
+		.endpoint_num = state->first == SOF ? 0 : state->endpoint_num,
+	};
+	file_write(&context->transactions, &context->current_transaction, 1);
+	file_write(&context->transaction_info, &info, 1);
+	// Update summary for filtering.
+	transaction_summarize(context);
+}
+
+// Record a completed transaction, or a packet outside any transaction.
+static inline void record_create(struct context *context, enum event_type type)
+{
+	struct record rec;
+	rec.type = type;
+	if (type == TRANSACTION) {
+		rec.transaction = context->current_transaction;
+		rec.state = context->transaction_state;
+	} else {
+		rec.transaction.first_packet_id = context->packet_id;
+	}
+	file_write(&context->records, &rec, 1);
 }
 
 // End a transaction if it was ongoing.
@@ -553,10 +1604,11 @@ static inline void transaction_end(struct context *context, bool complete)
 		{
 			// A transaction was in progress.
 			tran->complete = complete;
-			// Update transfer state.
-			transfer_update(context);
-			// Write out transaction.
-			file_write(&context->transactions, tran, 1);
+			// Record it for later, or decode it now.
+			if (context->deferred)
+				record_create(context, TRANSACTION);
+			else
+				transaction_commit(context);
 		}
 	}
 
@@ -591,163 +1643,3487 @@ static inline void transaction_update(struct context *context)
 	case TRANSACTION_INVALID:
 		// Packet not valid as part of any current transaction.
 		transaction_end(context, false);
-		event_create(context, PACKET);
+		if (context->deferred)
+			record_create(context, PACKET);
+		else
+			event_create(context, PACKET);
 		break;
 	}
 }
 
-struct capture* convert_capture(const char *filename)
-{
-	// Allocate new capture
-	struct capture *cap = malloc(sizeof(struct capture));
-	memset(cap, 0, sizeof(struct capture));
+// Table for computing CRC5 over the bits of a token or SOF packet.
+static uint8_t crc5_table[1 << TOKEN_CRC_BITS];
+// Tables for computing CRC16 over a byte, and over each byte of a slice.
+static uint16_t crc16_table[CRC16_SLICE][256];
+// Guard for building the CRC and state tables once.
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
 
-	// Set up context structure.
-	struct context context = {
-		.capture = cap,
-		.events = {
-			"events",
-			&cap->num_events,
-			sizeof(struct event),
-		},
-		.packets = {
-			"packets",
-			&cap->num_packets,
-			sizeof(struct packet),
-		},
-		.transactions = {
-			"transactions",
-			&cap->num_transactions,
-			sizeof(struct transaction),
-		},
-		.endpoints = {
-			"endpoints",
-			&cap->num_endpoints,
-			sizeof(struct endpoint),
-		},
-		.transfer_index = {
-			"transfer_index",
-			&cap->num_transfers,
-			sizeof(struct transfer_index_entry),
-		},
-		.data = {
-			"data",
-			&cap->data_size,
-			sizeof(uint8_t),
-		},
-		.transaction_state = {
-			.first = 0,
-			.last = 0,
-		},
-	};
+// CRC5 of the given number of bits of a value, one bit at a time.
+static uint8_t crc5_bits(uint32_t value, int num_bits)
+{
+	uint8_t crc = 0x1F;
+	for (int i = 0; i < num_bits; i++)
+		crc = ((crc ^ (value >> i)) & 1) ? (crc >> 1) ^ CRC5_POLY : crc >> 1;
+	return ~crc & 0x1F;
+}
 
-	// Open virtual files for capture data.
-	file_open(&context.events);
-	file_open(&context.packets);
-	file_open(&context.transactions);
-	file_open(&context.endpoints);
-	file_open(&context.transfer_index);
-	file_open(&context.data);
+// Build the CRC tables.
+static void crc_tables_init(void)
+{
+	for (uint32_t value = 0; value < (1 << TOKEN_CRC_BITS); value++)
+		crc5_table[value] = crc5_bits(value, TOKEN_CRC_BITS);
 
-	// Open input file
-	FILE* input_file = fopen(filename, "r");
+	for (int byte = 0; byte < 256; byte++) {
+		uint16_t crc = byte;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC16_POLY : crc >> 1;
+		crc16_table[0][byte] = crc;
+	}
 
-	while (1)
-	{
-		struct packet *pkt = &context.current_packet;
-		uint8_t buf[0x10000];
+	// Each further table advances the CRC by another zero byte.
+	for (int k = 1; k < CRC16_SLICE; k++)
+		for (int byte = 0; byte < 256; byte++) {
+			uint16_t crc = crc16_table[k - 1][byte];
+			crc16_table[k][byte] = (crc >> 8) ^ crc16_table[0][crc & 0xFF];
+		}
+}
 
-		// Read packet length.
-		uint16_t len;
-		if (fread(&len, 1, sizeof(len), input_file) < sizeof(len))
-			break;
+// Build all the tables used while decoding.
+static void tables_init(void)
+{
+	crc_tables_init();
+	state_tables_init();
+}
 
-		// Generate timestamp.
-		pkt->timestamp_ns = nanotime();
+// CRC16 of the payload of a data packet.
+//
+// Payloads are processed a slice at a time, looking up each byte of the
+// slice in its own table.
+static inline uint16_t crc16(const uint8_t *data, size_t length)
+{
+	uint16_t crc = 0xFFFF;
 
-		// Convert packet length to host format.
-		pkt->length = ntohs(len);
+	while (length >= CRC16_SLICE) {
+		uint64_t slice;
+		memcpy(&slice, data, CRC16_SLICE);
+		slice = le64toh(slice) ^ crc;
+		crc = crc16_table[7][slice & 0xFF] ^
+			crc16_table[6][(slice >> 8) & 0xFF] ^
+			crc16_table[5][(slice >> 16) & 0xFF] ^
+			crc16_table[4][(slice >> 24) & 0xFF] ^
+			crc16_table[3][(slice >> 32) & 0xFF] ^
+			crc16_table[2][(slice >> 40) & 0xFF] ^
+			crc16_table[1][(slice >> 48) & 0xFF] ^
+			crc16_table[0][slice >> 56];
+		data += CRC16_SLICE;
+		length -= CRC16_SLICE;
+	}
 
-		// Read remaining packet bytes.
-		if (fread(buf, 1, pkt->length, input_file) < pkt->length)
-			break;
+	while (length-- > 0)
+		crc = (crc >> 8) ^ crc16_table[0][(crc ^ *data++) & 0xFF];
 
-		// Is this a data packet?
-		bool pkt_is_data = (buf[0] & PID_TYPE_MASK) == DATA;
-
-		if (pkt_is_data) {
-			// Store PID in packet
-			pkt->pid = buf[0];
-			// Store CRC in packet
-			memcpy(&pkt->fields.data.crc, &buf[pkt->length - 2], 2);
-			// Store data bytes in separate file, noting offset in packet.
-			pkt->data_offset = cap->data_size;
-			file_write(&context.data, &buf[1], pkt->length - 3);
-		} else {
-			// Store all fields in packet
-			memcpy(&pkt->pid, buf, pkt->length);
-		}
+	return ~crc;
+}
 
-		// Update transaction state.
-		transaction_update(&context);
+// Whether a packet fails its CRC check, or is too short to hold its CRC.
+//
+// Handshakes and packets with invalid PIDs have no CRC, and never fail.
+static inline bool packet_crc_error(const uint8_t *buf, uint16_t length)
+{
+	if (length == 0)
+		return false;
 
-		// Write out packet.
-		file_write(&context.packets, pkt, 1);
+	switch (buf[0])
+	{
+	case OUT: case IN: case SETUP: case PING: case SOF: {
+		if (length != 3)
+			return true;
+		uint16_t token = buf[1] | buf[2] << 8;
+		return crc5_table[token & 0x7FF] != token >> TOKEN_CRC_BITS;
+	}
+	case SPLIT: {
+		if (length != 4)
+			return true;
+		uint32_t split = buf[1] | buf[2] << 8 | buf[3] << 16;
+		return crc5_bits(split, SPLIT_CRC_BITS) != split >> SPLIT_CRC_BITS;
 	}
+	case DATA0: case DATA1: case DATA2: case MDATA:
+		if (length < 3)
+			return true;
+		return crc16(&buf[1], length - 3) != (buf[length - 2] | buf[length - 1] << 8);
+	default:
+		return false;
+	}
+}
 
-	// Close input file.
-	fclose(input_file);
+// Whether a packet has a payload stored in the data array.
+static inline bool packet_has_data(uint8_t pid, uint16_t length)
+{
+	return length >= 3 && (pid & PID_TYPE_MASK) == DATA;
+}
 
-	// End any ongoing transaction.
-	transaction_end(&context, false);
+// Number of bytes of a packet stored in the data array: the payload of a
+// data packet, or for any other packet, the bytes beyond the first three,
+// such as the last byte of a SPLIT token.
+static inline uint16_t packet_data_length(uint16_t length)
+{
+	return length > 3 ? length - 3 : 0;
+}
 
-	// Map completed files as capture arrays.
-	cap->events = file_map(&context.events);
-	cap->packets = file_map(&context.packets);
-	cap->transactions = file_map(&context.transactions);
-	cap->data = file_map(&context.data);
-	cap->endpoints = file_map(&context.endpoints);
+// Parse a packet from its bytes on the wire, storing any payload data.
+static inline void packet_parse(struct context *context, struct packet *pkt,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	// Store timestamp.
+	pkt->timestamp_ns = timestamp_ns;
 
-	// Deal with per-endpoint data.
-	for (int i = 0; i < cap->num_endpoints; i++)
-	{
-		struct endpoint *ep = &cap->endpoints[i];
-		struct endpoint_state *ep_state = context.endpoint_states[ep->address][ep->endpoint_num];
-		struct endpoint_traffic *ep_traf = cap->endpoint_traffic[i];
+	// Store packet length.
+	pkt->length = length;
 
-		// End any transfer still ongoing on this endpoint as incomplete.
-		transfer_end(&context, ep_state, false);
+	// Is this a data packet?
+	bool pkt_is_data = packet_has_data(buf[0], length);
 
-		// Map completed files as endpoint traffic arrays.
-		ep_traf->transfers = file_map(&ep_state->transfers);
-		ep_traf->transaction_ids = file_map(&ep_state->transaction_ids);
+	// Check its CRC, if it has one.
+	pkt->crc_error = packet_crc_error(buf, length);
 
-		// Free memory allocated for this endpoint.
-		free(ep_state->transfers.name);
-		free(ep_state->transaction_ids.name);
-		free(ep_state);
+	if (pkt_is_data) {
+		// Store PID in packet
+		pkt->pid = buf[0];
+		// Store CRC in packet
+		memcpy(&pkt->fields.data.crc, &buf[length - 2], 2);
+		// Store data bytes in separate file, noting offset in packet.
+		pkt->data_offset = context->data_size;
+		data_write(context, &buf[1], length - 3);
+	} else {
+		// Store all fields in packet, leaving any missing ones zero.
+		size_t max_length = sizeof(pkt->pid) + sizeof(pkt->fields);
+		pkt->data_offset = 0;
+		memset(&pkt->pid, 0, max_length);
+		memcpy(&pkt->pid, buf, length < max_length ? length : max_length);
+		// Store any excess bytes in the data file.
+		if (length > max_length) {
+			pkt->data_offset = context->data_size;
+			data_write(context, &buf[max_length], length - max_length);
+		}
 	}
+}
 
-	// Map transfer index last, since we may have added pending transfers.
-	cap->transfer_index = file_map(&context.transfer_index);
-
-	return cap;
+// Add a packet to the summary of the current block of packets, and to
+// the bitmap of CRC errors, writing both out when the block is complete.
+static inline void packet_summarize(struct context *context, uint64_t id,
+	uint8_t pid, bool crc_error)
+{
+	context->packet_summary |= 1 << (pid & PID_MASK);
+	context->packet_crc_error_word |= (uint64_t) crc_error << (id % SUMMARY_BLOCK);
+	if ((id + 1) % SUMMARY_BLOCK == 0) {
+		file_write(&context->packet_summaries, &context->packet_summary, 1);
+		file_write(&context->packet_crc_errors, &context->packet_crc_error_word, 1);
+		context->packet_summary = 0;
+		context->packet_crc_error_word = 0;
+	}
 }
 
-void close_capture(struct capture *cap)
+// Write out a packet to the packet columns.
+static inline void packet_write(struct context *context, struct packet *pkt)
 {
-	for (int i = 0; i < cap->num_endpoints; i++) {
+	struct packet_checkpoint *checkpoint = &context->checkpoint;
+	uint64_t id = context->packet_pids.count;
+	uint64_t time_offset = pkt->timestamp_ns - checkpoint->timestamp_ns;
+
+	// Start a new group if the current one is full, or if the timestamp
+	// cannot be stored relative to its checkpoint.
+	if (id == 0 || id - checkpoint->first_packet_id == CHECKPOINT_INTERVAL
+			|| time_offset > UINT32_MAX) {
+		checkpoint->first_packet_id = id;
+		checkpoint->timestamp_ns = pkt->timestamp_ns;
+		checkpoint->data_offset = packet_data_length(pkt->length) ?
+			pkt->data_offset : context->data_size;
+		file_write(&context->packet_checkpoints, checkpoint, 1);
+		time_offset = 0;
+	}
+
+	uint32_t time_offset_32 = time_offset;
+	file_write(&context->packet_pids, &pkt->pid, 1);
+	file_write(&context->packet_lengths, &pkt->length, 1);
+	file_write(&context->packet_fields, &pkt->fields, 1);
+	file_write(&context->packet_time_offsets, &time_offset_32, 1);
+	packet_summarize(context, id, pkt->pid, pkt->crc_error);
+}
+
+// Decode a packet from its bytes on the wire.
+static inline void packet_decode(struct context *context,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	struct packet *pkt = &context->current_packet;
+
+	// Parse packet.
+	packet_parse(context, pkt, buf, length, timestamp_ns);
+
+	// Update transaction state.
+	context->packet_id = context->packet_pids.count;
+	context->packet_bytes = buf;
+	transaction_update(context);
+
+	// Write out packet.
+	packet_write(context, pkt);
+}
+
+// Write out the current run of repeated polls, if there were any repeats.
+static inline void run_end(struct context *context)
+{
+	if (context->run.count > 0)
+		file_write(&context->poll_runs, &context->run, 1);
+	context->run.count = 0;
+}
+
+// Start looking for a run of polls from the token with the given ID.
+static inline void run_start(struct context *context, uint64_t packet_id)
+{
+	uint16_t value = context->run_token[1] | context->run_token[2] << 8;
+	context->run.packet_id = packet_id;
+	context->run.count = 0;
+	context->run.address = value & 0x7F;
+	context->run.endpoint_num = (value >> 7) & 0x0F;
+	context->run_state = RUN_TOKEN;
+}
+
+// End the current run, if a token has been held back for it, and treat
+// that token as the next packet to be decoded.
+//
+// Returns true if a token was held back, and must now be decoded.
+static inline bool run_release(struct context *context)
+{
+	if (context->run_state != RUN_HELD)
+		return false;
+
+	run_end(context);
+	run_start(context, context->packet_pids.count);
+	return true;
+}
+
+// Update the search for runs of repeated polls with a new packet.
+static inline enum run_status run_update(struct context *context,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	bool token = length == 3 && buf[0] == IN && !packet_crc_error(buf, length);
+	bool nak = length == 1 && buf[0] == NAK;
+	enum run_status status = RUN_NONE;
+
+	switch (context->run_state)
+	{
+	case RUN_TOKEN:
+		// A NAK after the token completes a poll, which may be repeated.
+		if (nak) {
+			context->run_state = RUN_POLL;
+			return RUN_NONE;
+		}
+		break;
+	case RUN_POLL:
+		// Hold back a repeat of the token until it is known to be NAKed.
+		if (token && memcmp(buf, context->run_token, sizeof(context->run_token)) == 0) {
+			memcpy(context->run_held, buf, sizeof(context->run_held));
+			context->run_held_ns = timestamp_ns;
+			context->run_state = RUN_HELD;
+			return RUN_ABSORBED;
+		}
+		run_end(context);
+		break;
+	case RUN_HELD:
+		// A NAK after the token held back completes a repeat of the poll.
+		if (nak) {
+			struct poll_run *run = &context->run;
+			if (run->count == 0)
+				run->first_timestamp_ns = context->run_held_ns;
+			run->last_timestamp_ns = context->run_held_ns;
+			run->count++;
+			context->run_state = RUN_POLL;
+			return RUN_ABSORBED;
+		}
+		// Otherwise, the token must be decoded before this packet.
+		run_release(context);
+		status = RUN_RELEASED;
+		break;
+	case RUN_IDLE:
+		break;
+	}
+
+	// Note whether this packet may begin a new poll.
+	if (token) {
+		memcpy(context->run_token, buf, sizeof(context->run_token));
+		run_start(context, context->packet_pids.count + (status == RUN_RELEASED));
+	} else {
+		context->run_state = RUN_IDLE;
+	}
+
+	return status;
+}
+
+// Decode a packet from its bytes on the wire, collapsing repeated polls.
+static inline void packet_decode_runs(struct context *context,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	switch (run_update(context, buf, length, timestamp_ns))
+	{
+	case RUN_ABSORBED:
+		return;
+	case RUN_RELEASED:
+		packet_decode(context, context->run_held,
+			sizeof(context->run_held), context->run_held_ns);
+		break;
+	case RUN_NONE:
+		break;
+	}
+
+	packet_decode(context, buf, length, timestamp_ns);
+}
+
+// Initialise a batch queue.
+static inline void queue_init(struct batch_queue *queue)
+{
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+	queue->head = queue->tail = NULL;
+	queue->count = 0;
+	queue->stopped = false;
+}
+
+// Free resources used by a batch queue.
+static inline void queue_destroy(struct batch_queue *queue)
+{
+	pthread_mutex_destroy(&queue->mutex);
+	pthread_cond_destroy(&queue->cond);
+}
+
+// Add a batch to the end of a queue.
+static inline void queue_push(struct batch_queue *queue, struct batch *batch)
+{
+	pthread_mutex_lock(&queue->mutex);
+	batch->next = NULL;
+	if (queue->tail)
+		queue->tail->next = batch;
+	else
+		queue->head = batch;
+	queue->tail = batch;
+	queue->count++;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+// Take a batch from the front of a queue, waiting for one if necessary.
+//
+// Returns NULL once the queue is empty and stopped.
+static inline struct batch *queue_pop(struct batch_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	while (!queue->head && !queue->stopped)
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+	struct batch *batch = queue->head;
+	if (batch) {
+		queue->head = batch->next;
+		if (!queue->head)
+			queue->tail = NULL;
+		queue->count--;
+	}
+	pthread_mutex_unlock(&queue->mutex);
+	return batch;
+}
+
+// Wait until a queue holds the given number of batches.
+static inline void queue_wait(struct batch_queue *queue, int count)
+{
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->count < count)
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+// Mark a queue as stopped, waking any thread waiting on it.
+static inline void queue_stop(struct batch_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	queue->stopped = true;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+// Parse stage: parse each batch of packets and write them out.
+static void *parse_thread(void *arg)
+{
+	struct decoder *decoder = arg;
+	struct pipeline *pipeline = decoder->pipeline;
+	struct context *context = &decoder->context;
+	struct batch *batch;
+
+	while ((batch = queue_pop(&pipeline->parse)))
+	{
+		// Packets absorbed into runs of polls are dropped from the
+		// batch, so that the state stage does not see them.
+		uint32_t num_packets = 0;
+		batch->first_packet_id = context->packet_pids.count;
+		for (uint32_t i = 0; i < batch->num_packets; i++)
+		{
+			struct packet_location *loc = &batch->locations[i];
+			const uint8_t *buf = &batch->data[loc->offset];
+			if (context->runs) {
+				enum run_status status =
+					run_update(context, buf, loc->length, loc->timestamp_ns);
+				if (status == RUN_ABSORBED)
+					continue;
+				if (status == RUN_RELEASED) {
+					batch->bytes[num_packets] = NULL;
+					struct packet *pkt = &batch->packets[num_packets++];
+					packet_parse(context, pkt, context->run_held,
+						sizeof(context->run_held), context->run_held_ns);
+					packet_write(context, pkt);
+				}
+			}
+			batch->bytes[num_packets] = buf;
+			struct packet *pkt = &batch->packets[num_packets++];
+			packet_parse(context, pkt, buf, loc->length, loc->timestamp_ns);
+			packet_write(context, pkt);
+		}
+
+		// Pass on any token held back, rather than holding it across
+		// batches. A run may continue after it, as a new run.
+		if (run_release(context)) {
+			batch->bytes[num_packets] = NULL;
+			struct packet *pkt = &batch->packets[num_packets++];
+			packet_parse(context, pkt, context->run_held,
+				sizeof(context->run_held), context->run_held_ns);
+			packet_write(context, pkt);
+		}
+
+		batch->num_packets = num_packets;
+		queue_push(&pipeline->state, batch);
+	}
+
+	queue_stop(&pipeline->state);
+	return NULL;
+}
+
+// State stage: run each batch of packets through the state machines.
+static void *state_thread(void *arg)
+{
+	struct decoder *decoder = arg;
+	struct pipeline *pipeline = decoder->pipeline;
+	struct context *context = &decoder->context;
+	struct batch *batch;
+
+	while ((batch = queue_pop(&pipeline->state)))
+	{
+		for (uint32_t i = 0; i < batch->num_packets; i++)
+		{
+			context->current_packet = batch->packets[i];
+			context->packet_bytes = batch->bytes[i];
+			context->packet_id = batch->first_packet_id + i;
+			transaction_update(context);
+		}
+		queue_push(&pipeline->free, batch);
+	}
+
+	return NULL;
+}
+
+// Start a decoding pipeline, or if it cannot be allocated or its threads
+// started, leave the decoder to decode on the calling thread.
+static void pipeline_start(struct decoder *decoder)
+{
+	struct pipeline *pipeline = malloc(sizeof(struct pipeline));
+	if (!pipeline)
+		return;
+	decoder->pipeline = pipeline;
+	pipeline->current = NULL;
+	queue_init(&pipeline->free);
+	queue_init(&pipeline->parse);
+	queue_init(&pipeline->state);
+	bool allocated = true;
+	for (int i = 0; i < NUM_BATCHES; i++) {
+		pipeline->batches[i] = malloc(sizeof(struct batch));
+		if (pipeline->batches[i])
+			queue_push(&pipeline->free, pipeline->batches[i]);
+		else
+			allocated = false;
+	}
+
+	if (allocated &&
+			pthread_create(&pipeline->parse_thread, NULL, parse_thread, decoder) == 0) {
+		if (pthread_create(&pipeline->state_thread, NULL, state_thread, decoder) == 0)
+			return;
+		queue_stop(&pipeline->parse);
+		pthread_join(pipeline->parse_thread, NULL);
+	}
+
+	// Fall back to decoding on the calling thread.
+	for (int i = 0; i < NUM_BATCHES; i++)
+		free(pipeline->batches[i]);
+	queue_destroy(&pipeline->free);
+	queue_destroy(&pipeline->parse);
+	queue_destroy(&pipeline->state);
+	free(pipeline);
+	decoder->pipeline = NULL;
+}
+
+// Send the batch being filled, if any, on to the parse stage.
+static inline void pipeline_dispatch(struct pipeline *pipeline)
+{
+	if (pipeline->current) {
+		queue_push(&pipeline->parse, pipeline->current);
+		pipeline->current = NULL;
+	}
+}
+
+// Wait until all packets fed to the pipeline have been fully decoded.
+static void pipeline_flush(struct pipeline *pipeline)
+{
+	pipeline_dispatch(pipeline);
+	queue_wait(&pipeline->free, NUM_BATCHES);
+}
+
+// Flush the pipeline, then stop its threads and free it.
+static void pipeline_stop(struct pipeline *pipeline)
+{
+	pipeline_flush(pipeline);
+	queue_stop(&pipeline->parse);
+	pthread_join(pipeline->parse_thread, NULL);
+	pthread_join(pipeline->state_thread, NULL);
+	for (int i = 0; i < NUM_BATCHES; i++)
+		free(pipeline->batches[i]);
+	queue_destroy(&pipeline->free);
+	queue_destroy(&pipeline->parse);
+	queue_destroy(&pipeline->state);
+	free(pipeline);
+}
+
+// Add a framed packet to the batch being filled.
+static inline void pipeline_add(struct pipeline *pipeline,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	struct batch *batch = pipeline->current;
+
+	// Send on the current batch if it is full.
+	if (batch && (batch->num_packets == BATCH_PACKETS ||
+			batch->data_used + length > BATCH_DATA_SIZE)) {
+		pipeline_dispatch(pipeline);
+		batch = NULL;
+	}
+
+	// Start filling a free batch if needed.
+	if (!batch) {
+		batch = pipeline->current = queue_pop(&pipeline->free);
+		batch->num_packets = 0;
+		batch->data_used = 0;
+	}
+
+	// Copy packet into batch.
+	struct packet_location *loc = &batch->locations[batch->num_packets++];
+	loc->timestamp_ns = timestamp_ns;
+	loc->offset = batch->data_used;
+	loc->length = length;
+	memcpy(&batch->data[batch->data_used], buf, length);
+	batch->data_used += length;
+}
+
+// Publish provisional copies of transfers still in progress.
+static inline void transfers_publish(struct context *context)
+{
+	struct capture *cap = context->capture;
+
+	for (int i = 0; i < context->endpoints.count; i++)
+	{
+		struct endpoint *ep = &cap->endpoints[i];
+		struct endpoint_state *ep_state = context->endpoint_states[ep->address][ep->endpoint_num];
+		struct endpoint_traffic *ep_traf = cap->endpoint_traffic[i];
+		struct transfer xfer = ep_state->current_transfer;
+		uint64_t num_transfers = ep_state->transfers.count;
+
+		// Include an incomplete copy of any transfer in progress.
+		if (xfer.num_transactions > 0) {
+			xfer.complete = false;
+			file_write_provisional(&ep_state->transfers, &xfer);
+			file_write_provisional(&ep_state->transfer_info, &ep_state->current_info);
+			num_transfers++;
+		}
+
+		// Map files as endpoint traffic arrays.
+		ep_traf->transfers = file_map(&ep_state->transfers, num_transfers);
+		ep_traf->transfer_info = file_map(&ep_state->transfer_info, num_transfers);
+		ep_traf->transaction_ids = file_map(&ep_state->transaction_ids,
+			ep_state->transaction_ids.count);
+		ep_traf->num_transfers = num_transfers;
+		ep_traf->num_transaction_ids = ep_state->transaction_ids.count;
+	}
+}
+
+// Publish everything written so far to the capture.
+static inline void capture_publish(struct context *context)
+{
+	struct capture *cap = context->capture;
+
+	uint64_t data_stored_size = context->data.count;
+	uint64_t num_data_blocks = context->data_blocks.count;
+
+	// Include any payload data not yet compressed, as an uncompressed
+	// block just past the end of the stored data.
+	if (context->data_pending_size > 0) {
+		struct data_block block = {
+			.offset = context->data.count,
+			.stored_length = context->data_pending_size,
+			.length = context->data_pending_size,
+		};
+		file_flush(&context->data);
+		if (pwrite(context->data.fd, context->data_pending, block.length, block.offset)
+				!= block.length)
+			context->data.failed = true;
+		file_write_provisional(&context->data_blocks, &block);
+		data_stored_size += block.length;
+		num_data_blocks++;
+	}
+
+	// Map files as capture arrays.
+	cap->events = file_map(&context->events, context->events.count);
+	cap->packet_pids = file_map(&context->packet_pids, context->packet_pids.count);
+	cap->packet_lengths = file_map(&context->packet_lengths, context->packet_lengths.count);
+	cap->packet_fields = file_map(&context->packet_fields, context->packet_fields.count);
+	cap->packet_time_offsets = file_map(&context->packet_time_offsets,
+		context->packet_time_offsets.count);
+	cap->packet_checkpoints = file_map(&context->packet_checkpoints,
+		context->packet_checkpoints.count);
+	cap->transactions = file_map(&context->transactions, context->transactions.count);
+	cap->transaction_info = file_map(&context->transaction_info,
+		context->transaction_info.count);
+	cap->data = file_map(&context->data, data_stored_size);
+	cap->data_blocks = file_map(&context->data_blocks, num_data_blocks);
+	cap->endpoints = file_map(&context->endpoints, context->endpoints.count);
+	cap->transfer_index = file_map(&context->transfer_index, context->transfer_index.count);
+	cap->transaction_events = file_map(&context->transaction_events,
+		context->transaction_events.count);
+	cap->transfer_events = file_map(&context->transfer_events, context->transfer_events.count);
+	cap->packet_summaries = file_map(&context->packet_summaries,
+		context->packet_summaries.count);
+	cap->transaction_summaries = file_map(&context->transaction_summaries,
+		context->transaction_summaries.count);
+
+	// Include the current word of the bitmap of CRC errors, if the
+	// number of packets is not a multiple of its size.
+	uint64_t num_crc_error_words = context->packet_crc_errors.count;
+	if (context->packet_pids.count % SUMMARY_BLOCK != 0) {
+		file_write_provisional(&context->packet_crc_errors,
+			&context->packet_crc_error_word);
+		num_crc_error_words++;
+	}
+	cap->packet_crc_errors = file_map(&context->packet_crc_errors, num_crc_error_words);
+
+	// Include a provisional copy of any run of polls still in progress.
+	uint64_t num_poll_runs = context->poll_runs.count;
+	if (context->run.count > 0) {
+		file_write_provisional(&context->poll_runs, &context->run);
+		num_poll_runs++;
+	}
+	cap->poll_runs = file_map(&context->poll_runs, num_poll_runs);
+	cap->trigger_hits = file_map(&context->trigger_hits, context->trigger_hits.count);
+
+	// Deal with per-endpoint data.
+	transfers_publish(context);
+
+	// Update counts, now that all arrays are valid.
+	cap->num_events = context->events.count;
+	cap->num_packets = context->packet_pids.count;
+	cap->num_checkpoints = context->packet_checkpoints.count;
+	cap->num_transactions = context->transactions.count;
+	cap->data_size = context->data_size;
+	cap->data_stored_size = data_stored_size;
+	cap->num_data_blocks = num_data_blocks;
+	cap->num_endpoints = context->endpoints.count;
+	cap->num_transfers = context->transfer_index.count;
+	cap->num_packet_summaries = context->packet_summaries.count;
+	cap->num_transaction_summaries = context->transaction_summaries.count;
+	cap->num_crc_error_words = num_crc_error_words;
+	cap->num_poll_runs = num_poll_runs;
+	cap->num_trigger_hits = context->trigger_hits.count;
+}
+
+// Set up a context for decoding into the given capture.
+//
+// Returns false if memory could not be allocated, in which case the context
+// must still be freed.
+static bool context_init(struct context *context, struct capture *cap, unsigned int flags)
+{
+	// Set up context structure.
+	memset(context, 0, sizeof(struct context));
+	context->capture = cap;
+	context->events.name = "events";
+	context->events.item_size = sizeof(struct event);
+	context->packet_pids.name = "packet_pids";
+	context->packet_pids.item_size = sizeof(uint8_t);
+	context->packet_lengths.name = "packet_lengths";
+	context->packet_lengths.item_size = sizeof(uint16_t);
+	context->packet_fields.name = "packet_fields";
+	context->packet_fields.item_size = sizeof(uint16_t);
+	context->packet_time_offsets.name = "packet_time_offsets";
+	context->packet_time_offsets.item_size = sizeof(uint32_t);
+	context->packet_checkpoints.name = "packet_checkpoints";
+	context->packet_checkpoints.item_size = sizeof(struct packet_checkpoint);
+	context->transactions.name = "transactions";
+	context->transactions.item_size = sizeof(struct transaction);
+	context->endpoints.name = "endpoints";
+	context->endpoints.item_size = sizeof(struct endpoint);
+	context->transfer_index.name = "transfer_index";
+	context->transfer_index.item_size = sizeof(struct transfer_index_entry);
+	context->transaction_info.name = "transaction_info";
+	context->transaction_info.item_size = sizeof(struct transaction_info);
+	context->transaction_events.name = "transaction_events";
+	context->transaction_events.item_size = sizeof(uint64_t);
+	context->transfer_events.name = "transfer_events";
+	context->transfer_events.item_size = sizeof(uint64_t);
+	context->packet_summaries.name = "packet_summaries";
+	context->packet_summaries.item_size = sizeof(uint16_t);
+	context->transaction_summaries.name = "transaction_summaries";
+	context->transaction_summaries.item_size = sizeof(struct filter);
+	context->packet_crc_errors.name = "packet_crc_errors";
+	context->packet_crc_errors.item_size = sizeof(uint64_t);
+	context->poll_runs.name = "poll_runs";
+	context->poll_runs.item_size = sizeof(struct poll_run);
+	context->trigger_hits.name = "trigger_hits";
+	context->trigger_hits.item_size = sizeof(struct trigger_hit);
+	context->data.name = "data";
+	context->data.item_size = sizeof(uint8_t);
+	context->data_blocks.name = "data_blocks";
+	context->data_blocks.item_size = sizeof(struct data_block);
+
+	// Open virtual files for capture data.
+	file_open(&context->events);
+	file_open(&context->packet_pids);
+	file_open(&context->packet_lengths);
+	file_open(&context->packet_fields);
+	file_open(&context->packet_time_offsets);
+	file_open(&context->packet_checkpoints);
+	file_open(&context->transactions);
+	file_open(&context->endpoints);
+	file_open(&context->transfer_index);
+	file_open(&context->transaction_info);
+	file_open(&context->transaction_events);
+	file_open(&context->transfer_events);
+	file_open(&context->packet_summaries);
+	file_open(&context->transaction_summaries);
+	file_open(&context->packet_crc_errors);
+	file_open(&context->poll_runs);
+	file_open(&context->trigger_hits);
+	file_open(&context->data);
+	file_open(&context->data_blocks);
+
+	// Collapse runs of repeated polls, if required.
+	context->runs = (flags & DECODER_POLL_RUNS) != 0;
+
+	// Allocate buffers for compressing payload data, if required.
+	if (flags & DECODER_COMPRESSED) {
+		context->compressed = true;
+		context->data_pending = malloc(DATA_BLOCK_SIZE);
+		context->data_compressed = malloc(DATA_BLOCK_SIZE);
+		context->data_readback = malloc(DATA_BLOCK_SIZE);
+		if (!context->data_pending || !context->data_compressed || !context->data_readback)
+			return false;
+	}
+
+	return true;
+}
+
+// Close the files of a context and free memory used for decoding. The
+// capture remains valid.
+static void context_free(struct context *context)
+{
+	// Close files and free memory allocated for each endpoint.
+	for (int i = 0; i < MAX_DEVICES; i++)
+	{
+		for (int j = 0; j < MAX_ENDPOINTS; j++)
+		{
+			struct endpoint_state *ep_state = context->endpoint_states[i][j];
+			if (!ep_state)
+				continue;
+			file_close(&ep_state->transfers);
+			file_close(&ep_state->transaction_ids);
+			file_close(&ep_state->transfer_info);
+			free(ep_state->transfers.name);
+			free(ep_state->transaction_ids.name);
+			free(ep_state->transfer_info.name);
+			free(ep_state);
+		}
+	}
+
+	// Close main files.
+	file_close(&context->events);
+	file_close(&context->packet_pids);
+	file_close(&context->packet_lengths);
+	file_close(&context->packet_fields);
+	file_close(&context->packet_time_offsets);
+	file_close(&context->packet_checkpoints);
+	file_close(&context->transactions);
+	file_close(&context->endpoints);
+	file_close(&context->transfer_index);
+	file_close(&context->transaction_info);
+	file_close(&context->transaction_events);
+	file_close(&context->transfer_events);
+	file_close(&context->packet_summaries);
+	file_close(&context->transaction_summaries);
+	file_close(&context->packet_crc_errors);
+	file_close(&context->poll_runs);
+	file_close(&context->trigger_hits);
+	file_close(&context->data);
+	file_close(&context->data_blocks);
+
+	// Free buffers used for compressing payload data.
+	free(context->data_pending);
+	free(context->data_compressed);
+	free(context->data_readback);
+	free(context->dedup_table);
+}
+
+// Check whether any data decoded into a context was lost, so that its
+// capture is incomplete.
+static bool context_failed(struct context *context)
+{
+	for (int i = 0; i < MAX_DEVICES; i++)
+	{
+		for (int j = 0; j < MAX_ENDPOINTS; j++)
+		{
+			struct endpoint_state *ep_state = context->endpoint_states[i][j];
+			if (ep_state && (ep_state->transfers.failed ||
+					ep_state->transaction_ids.failed ||
+					ep_state->transfer_info.failed))
+				return true;
+		}
+	}
+
+	return context->failed ||
+		context->events.failed ||
+		context->packet_pids.failed ||
+		context->packet_lengths.failed ||
+		context->packet_fields.failed ||
+		context->packet_time_offsets.failed ||
+		context->packet_checkpoints.failed ||
+		context->transactions.failed ||
+		context->endpoints.failed ||
+		context->transfer_index.failed ||
+		context->transaction_info.failed ||
+		context->transaction_events.failed ||
+		context->transfer_events.failed ||
+		context->packet_summaries.failed ||
+		context->transaction_summaries.failed ||
+		context->packet_crc_errors.failed ||
+		context->poll_runs.failed ||
+		context->trigger_hits.failed ||
+		context->data.failed ||
+		context->data_blocks.failed ||
+		context->records.failed;
+}
+
+struct decoder* decoder_open(unsigned int flags)
+{
+	// Allocate new decoder and capture.
+	struct decoder *decoder = calloc(1, sizeof(struct decoder));
+	struct capture *cap = calloc(1, sizeof(struct capture));
+	if (!decoder || !cap) {
+		free(decoder);
+		free(cap);
+		return NULL;
+	}
+	decoder->read_buffer = malloc(READ_SIZE);
+	decoder->flags = flags;
+
+	// Build the tables used while decoding, if not already done.
+	pthread_once(&tables_once, tables_init);
+
+	// Set up context structure.
+	if (!context_init(&decoder->context, cap, flags) || !decoder->read_buffer) {
+		context_free(&decoder->context);
+		free(decoder->read_buffer);
+		free(decoder);
+		free(cap);
+		return NULL;
+	}
+
+	// Start decoding pipeline if requested, and if there are other
+	// CPUs for its threads to run on.
+	if ((flags & DECODER_PIPELINED) && sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		pipeline_start(decoder);
+
+	return decoder;
+}
+
+// Description of an array belonging to a capture.
+struct capture_array {
+	// Location of the pointer to the array.
+	void **data;
+	// Location of the count of items in the array.
+	uint64_t *count;
+	// Size of each item.
+	size_t item_size;
+};
+
+// List the arrays belonging to a capture, in the order they are saved.
+//
+// The caller must free the returned list.
+static struct capture_array *capture_arrays(struct capture *cap, size_t *num_arrays)
+{
+	*num_arrays = MAIN_ARRAYS + ENDPOINT_ARRAYS * cap->num_endpoints;
+	struct capture_array *arrays = malloc(*num_arrays * sizeof(struct capture_array));
+	struct capture_array *array = arrays;
+
+	// Main arrays.
+	*array++ = (struct capture_array) {
+		(void **) &cap->events, &cap->num_events, sizeof(struct event) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->packet_pids, &cap->num_packets, sizeof(uint8_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->packet_lengths, &cap->num_packets, sizeof(uint16_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->packet_fields, &cap->num_packets, sizeof(uint16_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->packet_time_offsets, &cap->num_packets, sizeof(uint32_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->packet_checkpoints, &cap->num_checkpoints,
+		sizeof(struct packet_checkpoint) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->transactions, &cap->num_transactions, sizeof(struct transaction) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->transaction_info, &cap->num_transactions,
+		sizeof(struct transaction_info) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->transaction_events, &cap->num_transactions, sizeof(uint64_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->endpoints, &cap->num_endpoints, sizeof(struct endpoint) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->transfer_index, &cap->num_transfers, sizeof(struct transfer_index_entry) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->transfer_events, &cap->num_transfers, sizeof(uint64_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->data, &cap->data_stored_size, sizeof(uint8_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->data_blocks, &cap->num_data_blocks, sizeof(struct data_block) };
+
+	*array++ = (struct capture_array) {
+		(void **) &cap->packet_summaries, &cap->num_packet_summaries, sizeof(uint16_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->transaction_summaries, &cap->num_transaction_summaries,
+		sizeof(struct filter) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->packet_crc_errors, &cap->num_crc_error_words, sizeof(uint64_t) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->poll_runs, &cap->num_poll_runs, sizeof(struct poll_run) };
+	*array++ = (struct capture_array) {
+		(void **) &cap->trigger_hits, &cap->num_trigger_hits, sizeof(struct trigger_hit) };
+
+	// Per-endpoint arrays.
+	for (int i = 0; i < cap->num_endpoints; i++) {
 		struct endpoint_traffic *ep_traf = cap->endpoint_traffic[i];
-		munmap(ep_traf->transfers, sizeof(struct transfer) * ep_traf->num_transfers);
-		munmap(ep_traf->transaction_ids, sizeof(uint64_t) * ep_traf->num_transaction_ids);
-		free(ep_traf);
-	}
-	munmap(cap->events, sizeof(struct event) * cap->num_events);
-	munmap(cap->packets, sizeof(struct packet) * cap->num_packets);
-	munmap(cap->transactions, sizeof(struct transaction) * cap->num_transactions);
-	munmap(cap->endpoints, sizeof(struct endpoint) * cap->num_endpoints);
-	munmap(cap->transfer_index, sizeof(struct transfer_index_entry) * cap->num_transfers);
-	munmap(cap->data, cap->data_size);
+		*array++ = (struct capture_array) {
+			(void **) &ep_traf->transfers, &ep_traf->num_transfers, sizeof(struct transfer) };
+		*array++ = (struct capture_array) {
+			(void **) &ep_traf->transfer_info, &ep_traf->num_transfers,
+			sizeof(struct transfer_info) };
+		*array++ = (struct capture_array) {
+			(void **) &ep_traf->transaction_ids, &ep_traf->num_transaction_ids, sizeof(uint64_t) };
+	}
+
+	return arrays;
+}
+
+// Unmap a capture's arrays and free memory allocated for it, apart from
+// the capture structure itself.
+static void capture_unmap(struct capture *cap)
+{
+	size_t num_arrays;
+	struct capture_array *arrays = capture_arrays(cap, &num_arrays);
+	for (int i = 0; i < num_arrays; i++)
+		if (*arrays[i].data)
+			munmap(*arrays[i].data, *arrays[i].count * arrays[i].item_size);
+	free(arrays);
+	for (int i = 0; i < cap->num_endpoints; i++)
+		free(cap->endpoint_traffic[i]);
 	free(cap->endpoint_traffic);
+	free(cap->data_cache);
+}
+
+// Copy bytes into a rolling window at the given position, wrapping at the end.
+static inline void window_write(struct window *window,
+	uint64_t position, const void *src, size_t length)
+{
+	size_t offset = position % window->capacity;
+	size_t count = window->capacity - offset;
+	if (count > length)
+		count = length;
+	memcpy(&window->buffer[offset], src, count);
+	memcpy(window->buffer, (const uint8_t *) src + count, length - count);
+}
+
+// Copy bytes out of a rolling window from the given position.
+static inline void window_read(struct window *window,
+	uint64_t position, void *dest, size_t length)
+{
+	size_t offset = position % window->capacity;
+	size_t count = window->capacity - offset;
+	if (count > length)
+		count = length;
+	memcpy(dest, &window->buffer[offset], count);
+	memcpy((uint8_t *) dest + count, window->buffer, length - count);
+}
+
+// Add a packet to a rolling window, discarding the oldest to make room,
+// apart from any that a rebuild in progress has yet to decode.
+static inline void window_add(struct window *window,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	struct window_header header = { .timestamp_ns = timestamp_ns, .length = length };
+	uint64_t size = sizeof(header) + length;
+
+	while (window->tail - window->head + size > window->max_bytes &&
+			!(window->rebuild && window->head >= window->rebuild->evictable)) {
+		struct window_header oldest;
+		window_read(window, window->head, &oldest, sizeof(oldest));
+		window->head += sizeof(oldest) + oldest.length;
+	}
+
+	window_write(window, window->tail, &header, sizeof(header));
+	window_write(window, window->tail + sizeof(header), buf, length);
+	window->tail += size;
+
+	if (window->decoded == 0)
+		window->start_ns = timestamp_ns;
+	window->decoded += size;
+}
+
+// Whether a capture should be rebuilt from its rolling window, after a
+// packet with the given timestamp.
+static inline bool window_full(struct window *window, uint64_t timestamp_ns)
+{
+	return window->decoded > 2 * window->max_bytes ||
+		(window->max_ns > 0 && timestamp_ns - window->start_ns > 2 * window->max_ns);
+}
+
+// Decode a packet from a rolling window, given its header.
+static inline void window_decode(struct window *window, struct context *context,
+	uint64_t position, const struct window_header *header, uint8_t *packet)
+{
+	window_read(window, position + sizeof(*header), packet, header->length);
+	if (context->runs)
+		packet_decode_runs(context, packet, header->length, header->timestamp_ns);
+	else
+		packet_decode(context, packet, header->length, header->timestamp_ns);
+}
+
+// Decode the packets in a rolling window into a new capture, skipping
+// those older than the time span of the window, until caught up with
+// the packets added to it.
+static void *rebuild_thread(void *arg)
+{
+	struct rebuild *rebuild = arg;
+	struct window *window = rebuild->window;
+	struct window_header header;
+	uint64_t pos = rebuild->start;
+
+	pthread_mutex_lock(&rebuild->mutex);
+	while (!rebuild->stop && pos < rebuild->tail) {
+		uint64_t end = rebuild->tail;
+		if (end - pos > REBUILD_STEP)
+			end = pos + REBUILD_STEP;
+		pthread_mutex_unlock(&rebuild->mutex);
+
+		for (; pos < end; pos += sizeof(header) + header.length) {
+			window_read(window, pos, &header, sizeof(header));
+			if (pos == rebuild->start) {
+				if (window->max_ns > 0 &&
+						rebuild->newest_ns - header.timestamp_ns > window->max_ns) {
+					rebuild->start += sizeof(header) + header.length;
+					continue;
+				}
+				rebuild->start_ns = header.timestamp_ns;
+			}
+			window_decode(window, &rebuild->context, pos, &header, rebuild->packet);
+		}
+
+		// Let the feeding thread discard the packets decoded.
+		pthread_mutex_lock(&rebuild->mutex);
+		rebuild->decoded = pos;
+		if (rebuild->waiting)
+			pthread_cond_broadcast(&rebuild->cond);
+	}
+	rebuild->done = true;
+	pthread_cond_broadcast(&rebuild->cond);
+	pthread_mutex_unlock(&rebuild->mutex);
+
+	return NULL;
+}
+
+// Pass the packets added to a rolling window on to the rebuild in
+// progress, waiting until the window has room for the given number of
+// bytes more without discarding any packets not yet decoded.
+//
+// Returns whether the rebuild has caught up, and is ready to finish.
+static bool rebuild_exchange(struct window *window, uint64_t size)
+{
+	struct rebuild *rebuild = window->rebuild;
+
+	pthread_mutex_lock(&rebuild->mutex);
+	rebuild->tail = window->tail;
+	rebuild->waiting = true;
+	while (!rebuild->done && window->tail + size - rebuild->decoded > window->capacity)
+		pthread_cond_wait(&rebuild->cond, &rebuild->mutex);
+	rebuild->waiting = false;
+	rebuild->evictable = rebuild->decoded;
+	bool done = rebuild->done;
+	pthread_mutex_unlock(&rebuild->mutex);
+
+	return done;
+}
+
+// Free a rebuild, after its thread has finished.
+static void rebuild_free(struct rebuild *rebuild)
+{
+	pthread_mutex_destroy(&rebuild->mutex);
+	pthread_cond_destroy(&rebuild->cond);
+	free(rebuild->capture);
+	free(rebuild);
+}
+
+// Finish rebuilding a capture, and replace the current one with it.
+//
+// The capture structure itself is kept, so that references to it remain
+// valid, but all its arrays are replaced.
+static void rebuild_finish(struct decoder *decoder)
+{
+	struct context *context = &decoder->context;
+	struct capture *cap = context->capture;
+	struct window *window = decoder->window;
+	struct rebuild *rebuild = window->rebuild;
+	struct window_header header;
+
+	if (rebuild->threaded)
+		pthread_join(rebuild->thread, NULL);
+
+	// Decode any packets added since the rebuild last caught up.
+	for (uint64_t pos = rebuild->decoded; pos < window->tail;
+			pos += sizeof(header) + header.length) {
+		window_read(window, pos, &header, sizeof(header));
+		if (pos == rebuild->start)
+			rebuild->start_ns = header.timestamp_ns;
+		window_decode(window, &rebuild->context, pos, &header, rebuild->packet);
+	}
+
+	// Let the pipeline finish with the current capture.
+	if (decoder->pipeline)
+		pipeline_flush(decoder->pipeline);
+
+	// Discard the current capture and put the new one in its place.
+	uint64_t generation = cap->window_generation;
+	capture_publish(context);
+	context_free(context);
+	capture_unmap(cap);
+	*cap = *rebuild->capture;
+	cap->window_generation = generation + 1;
+	*context = rebuild->context;
+	context->capture = cap;
+
+	window->decoded = window->tail - rebuild->start;
+	window->start_ns = rebuild->start_ns;
+	window->rebuild = NULL;
+	rebuild_free(rebuild);
+}
+
+// Start rebuilding a capture from the packets in its decoder's rolling
+// window, discarding everything older, after a packet with the given
+// timestamp which is not yet in the window.
+//
+// If memory for the rebuild cannot be allocated, the capture keeps growing
+// until a later packet starts one.
+static void rebuild_start(struct decoder *decoder, uint64_t newest_ns)
+{
+	struct window *window = decoder->window;
+	struct rebuild *rebuild = calloc(1, sizeof(struct rebuild));
+	struct capture *cap = calloc(1, sizeof(struct capture));
+	if (!rebuild || !cap) {
+		free(rebuild);
+		free(cap);
+		return;
+	}
+	rebuild->window = window;
+	rebuild->capture = cap;
+	if (!context_init(&rebuild->context, cap, decoder->flags)) {
+		context_free(&rebuild->context);
+		free(rebuild);
+		free(cap);
+		return;
+	}
+	rebuild->newest_ns = newest_ns;
+	rebuild->start = window->head;
+	rebuild->evictable = window->head;
+	rebuild->decoded = window->head;
+	rebuild->tail = window->tail;
+	pthread_mutex_init(&rebuild->mutex, NULL);
+	pthread_cond_init(&rebuild->cond, NULL);
+	window->rebuild = rebuild;
+
+	// Rebuild on this thread if no other can be started.
+	rebuild->threaded =
+		(pthread_create(&rebuild->thread, NULL, rebuild_thread, rebuild) == 0);
+	if (!rebuild->threaded) {
+		rebuild_thread(rebuild);
+		rebuild_finish(decoder);
+	}
+}
+
+// Stop any rebuild of a capture from a window, discarding its result.
+static void rebuild_cancel(struct window *window)
+{
+	struct rebuild *rebuild = window->rebuild;
+	if (!rebuild)
+		return;
+
+	pthread_mutex_lock(&rebuild->mutex);
+	rebuild->stop = true;
+	pthread_mutex_unlock(&rebuild->mutex);
+	if (rebuild->threaded)
+		pthread_join(rebuild->thread, NULL);
+
+	capture_publish(&rebuild->context);
+	context_free(&rebuild->context);
+	capture_unmap(rebuild->capture);
+	window->rebuild = NULL;
+	rebuild_free(rebuild);
+}
+
+// End any run of polls, transaction and transfers still in progress,
+// at the end of the packets decoded or at a break in them.
+static void context_end(struct context *context)
+{
+	// Decode any token held back from a run of polls, and end the run.
+	if (run_release(context))
+		packet_decode(context, context->run_held,
+			sizeof(context->run_held), context->run_held_ns);
+	run_end(context);
+	context->run_state = RUN_IDLE;
+
+	// End any ongoing transaction.
+	transaction_end(context, false);
+
+	// End any transfer still ongoing on each endpoint as incomplete.
+	for (int i = 0; i < MAX_DEVICES; i++)
+		for (int j = 0; j < MAX_ENDPOINTS; j++)
+			if (context->endpoint_states[i][j])
+				transfer_end(context, context->endpoint_states[i][j], false);
+}
+
+// Decode a packet directly, or pass it to the pipeline.
+static inline void packet_dispatch(struct decoder *decoder,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	if (decoder->pipeline)
+		pipeline_add(decoder->pipeline, buf, length, timestamp_ns);
+	else if (decoder->context.runs)
+		packet_decode_runs(&decoder->context, buf, length, timestamp_ns);
+	else
+		packet_decode(&decoder->context, buf, length, timestamp_ns);
+}
+
+// Check a packet against the conditions of a trigger, updating the state
+// needed to do so.
+//
+// Returns the condition met, or -1 if the trigger does not fire.
+static inline int trigger_check(struct trigger_state *state,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	struct trigger *conditions = &state->conditions;
+	uint8_t pid = length > 0 ? buf[0] : 0;
+	int condition = -1;
+
+	if (conditions->gap_ns && state->last_ns &&
+			timestamp_ns - state->last_ns > conditions->gap_ns)
+		condition = TRIGGER_GAP;
+	state->last_ns = timestamp_ns;
+
+	if (conditions->crc_error && packet_crc_error(buf, length))
+		condition = TRIGGER_CRC_ERROR;
+
+	// The data packet of a setup stage holds bmRequestType then bRequest.
+	if (state->setup && pid == DATA0 && length >= 3) {
+		uint8_t request = buf[2];
+		if (conditions->setup_requests[request / 64] & (1ULL << (request % 64)))
+			condition = TRIGGER_SETUP_REQUEST;
+	}
+	state->setup = false;
+
+	switch (pid)
+	{
+	case OUT: case IN: case SETUP: case PING:
+		if (length != 3)
+			break;
+		state->token_pid = pid;
+		state->token_address = buf[1] & 0x7F;
+		state->token_endpoint = (buf[1] >> 7 | buf[2] << 1) & 0x0F;
+		state->setup = (pid == SETUP);
+		break;
+	case ACK: case NAK: case STALL: case NYET:
+		for (int i = 0; i < TRIGGER_HANDSHAKES && length == 1 && state->token_pid; i++) {
+			struct filter *handshakes = &conditions->handshakes[i];
+			if ((handshakes->results & (1 << (pid & PID_MASK)))
+					&& (!(handshakes->addresses[0] | handshakes->addresses[1])
+						|| (handshakes->addresses[state->token_address / 64]
+							& (1ULL << (state->token_address % 64))))
+					&& (!handshakes->endpoints
+						|| (handshakes->endpoints & (1 << state->token_endpoint))))
+				condition = TRIGGER_HANDSHAKE;
+		}
+		state->token_pid = 0;
+		break;
+	case SOF:
+		state->token_pid = 0;
+		break;
+	}
+
+	return condition;
+}
+
+// Pass a packet through a trigger, recording any hit, and decoding the
+// packets held back from before it if they are not already decoded.
+//
+// Returns whether the packet itself should be decoded.
+static inline bool trigger_receive(struct decoder *decoder,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	struct trigger_state *state = decoder->trigger;
+	struct window *held = state->held;
+	int condition = trigger_check(state, buf, length, timestamp_ns);
+
+	if (condition >= 0) {
+		struct trigger_hit hit = {
+			.timestamp_ns = timestamp_ns,
+			.condition = condition,
+		};
+		file_write(&decoder->context.trigger_hits, &hit, 1);
+
+		// Find the packets held back from the time before the hit,
+		// skipping any already decoded for an earlier one.
+		struct window_header header;
+		uint64_t pos = state->decoded > held->head ? state->decoded : held->head;
+		for (; pos < held->tail; pos += sizeof(header) + header.length) {
+			window_read(held, pos, &header, sizeof(header));
+			if (header.timestamp_ns + state->conditions.pre_ns >= timestamp_ns)
+				break;
+		}
+
+		// If any packets were left out since those kept for an earlier
+		// hit, end everything in progress, so that nothing continues
+		// across the break.
+		if (state->fired && pos != state->decoded) {
+			if (decoder->pipeline)
+				pipeline_flush(decoder->pipeline);
+			context_end(&decoder->context);
+		}
+
+		for (; pos < held->tail; pos += sizeof(header) + header.length) {
+			window_read(held, pos, &header, sizeof(header));
+			window_read(held, pos + sizeof(header), held->packet, header.length);
+			packet_dispatch(decoder, held->packet, header.length, header.timestamp_ns);
+		}
+
+		state->fired = true;
+		state->keep_until_ns = timestamp_ns + state->conditions.post_ns;
+	}
+
+	// Hold back packets not kept, in case they precede a later hit.
+	bool keep = state->fired && timestamp_ns <= state->keep_until_ns;
+	if (keep)
+		state->decoded = held->tail;
+	else
+		window_add(held, buf, length, timestamp_ns);
+	return keep;
+}
+
+// Handle a packet found in the stream, decoding it directly or passing
+// it to the pipeline.
+static inline void packet_receive(struct decoder *decoder,
+	const uint8_t *buf, uint16_t length, uint64_t timestamp_ns)
+{
+	// Keep the packet in any rolling window, starting to rebuild the
+	// capture from the window when it is full, and keeping any rebuild
+	// in progress supplied with packets until it has caught up.
+	struct window *window = decoder->window;
+	if (window) {
+		struct rebuild *rebuild = window->rebuild;
+		uint64_t size = sizeof(struct window_header) + length;
+		if (rebuild) {
+			if ((window->tail - rebuild->tail >= REBUILD_STEP ||
+					window->tail + size - rebuild->evictable > window->capacity) &&
+					rebuild_exchange(window, size))
+				rebuild_finish(decoder);
+		} else if (window_full(window, timestamp_ns)) {
+			rebuild_start(decoder, timestamp_ns);
+		}
+		window_add(window, buf, length, timestamp_ns);
+	}
+
+	// Decode only packets around those firing any trigger.
+	if (decoder->trigger && !trigger_receive(decoder, buf, length, timestamp_ns))
+		return;
+
+	packet_dispatch(decoder, buf, length, timestamp_ns);
+}
+
+// Allocate a window to hold up to the given number of bytes of packets,
+// in a buffer the given number of times that size.
+static struct window *window_alloc(uint64_t max_bytes, uint64_t max_ns, int factor)
+{
+	// The window must have room for at least the largest packet.
+	size_t min_bytes = sizeof(struct window_header) + MAX_PACKET_SIZE;
+	if (max_bytes < min_bytes)
+		max_bytes = min_bytes;
+
+	struct window *window = malloc(sizeof(struct window) + factor * max_bytes);
+	memset(window, 0, sizeof(struct window));
+	window->max_bytes = max_bytes;
+	window->max_ns = max_ns;
+	window->capacity = factor * max_bytes;
+	return window;
+}
+
+void decoder_window(struct decoder *decoder, uint64_t max_bytes, uint64_t max_ns)
+{
+	if (decoder->window)
+		rebuild_cancel(decoder->window);
+	free(decoder->window);
+	// Leave room for as many packets again to arrive during a rebuild.
+	decoder->window = window_alloc(max_bytes, max_ns, 2);
+}
+
+void decoder_trigger(struct decoder *decoder, const struct trigger *trigger, uint64_t max_bytes)
+{
+	struct trigger_state *state = malloc(sizeof(struct trigger_state));
+	memset(state, 0, sizeof(struct trigger_state));
+	state->conditions = *trigger;
+	state->held = window_alloc(max_bytes, 0, 1);
+	if (decoder->trigger)
+		free(decoder->trigger->held);
+	free(decoder->trigger);
+	decoder->trigger = state;
+}
+
+// Timestamp for a packet starting at the given offset in the data being fed.
+static inline uint64_t stream_timestamp(struct decoder *decoder, size_t offset)
+{
+	if (decoder->format == FORMAT_TIMESTAMPED)
+		return block_timestamp(&decoder->block, decoder->block_offset + offset);
+	else
+		return nanotime();
+}
+
+// Decode packets from raw stream data. Packets may be split across calls.
+static inline void stream_feed(struct decoder *decoder, const uint8_t *data, size_t length)
+{
+	const uint8_t *start = data;
+
+	// Complete any packet split across the previous call.
+	while (decoder->pending > 0)
+	{
+		size_t needed = LENGTH_SIZE;
+		if (decoder->pending >= LENGTH_SIZE)
+			needed += decoder->partial[0] << 8 | decoder->partial[1];
+
+		if (decoder->pending < needed) {
+			// Take as much as we can of what is still missing.
+			if (length == 0)
+				return;
+			size_t count = needed - decoder->pending;
+			if (count > length)
+				count = length;
+			memcpy(&decoder->partial[decoder->pending], data, count);
+			decoder->pending += count;
+			data += count;
+			length -= count;
+		} else {
+			// Packet is complete.
+			packet_receive(decoder,
+				&decoder->partial[LENGTH_SIZE],
+				needed - LENGTH_SIZE,
+				decoder->partial_timestamp);
+			decoder->pending = 0;
+		}
+	}
+
+	// Decode complete packets directly from the input.
+	while (length >= LENGTH_SIZE)
+	{
+		uint16_t packet_length = data[0] << 8 | data[1];
+		if (length < LENGTH_SIZE + packet_length)
+			break;
+		packet_receive(decoder,
+			&data[LENGTH_SIZE], packet_length,
+			stream_timestamp(decoder, data - start));
+		data += LENGTH_SIZE + packet_length;
+		length -= LENGTH_SIZE + packet_length;
+	}
+
+	// Keep any remaining bytes for the next call.
+	if (length > 0) {
+		memcpy(decoder->partial, data, length);
+		decoder->pending = length;
+		decoder->partial_timestamp = stream_timestamp(decoder, data - start);
+	}
+}
+
+// Accumulate a header which may be split between calls to decoder_feed().
+//
+// Returns true once the header is complete in decoder->header.
+static inline bool header_take(struct decoder *decoder,
+	const uint8_t **data, size_t *length, size_t size)
+{
+	size_t count = size - decoder->header_pending;
+	if (count > *length)
+		count = *length;
+	memcpy(&decoder->header[decoder->header_pending], *data, count);
+	decoder->header_pending += count;
+	*data += count;
+	*length -= count;
+	if (decoder->header_pending < size)
+		return false;
+	decoder->header_pending = 0;
+	return true;
+}
+
+void decoder_feed(struct decoder *decoder, const uint8_t *data, size_t length)
+{
+	// Identify the stream format from its first bytes.
+	if (decoder->format == FORMAT_UNKNOWN) {
+		if (!header_take(decoder, &data, &length, LENGTH_SIZE))
+			return;
+		if (memcmp(decoder->header, STREAM_MAGIC, LENGTH_SIZE) == 0) {
+			decoder->format = FORMAT_TIMESTAMPED;
+			decoder->skip = STREAM_MAGIC_SIZE - LENGTH_SIZE;
+		} else {
+			decoder->format = FORMAT_RAW;
+			stream_feed(decoder, decoder->header, LENGTH_SIZE);
+		}
+	}
+
+	// A raw stream needs no further processing.
+	if (decoder->format == FORMAT_RAW) {
+		stream_feed(decoder, data, length);
+		return;
+	}
+
+	// Skip the remainder of the stream magic.
+	size_t count = decoder->skip < length ? decoder->skip : length;
+	decoder->skip -= count;
+	data += count;
+	length -= count;
+
+	// Split timestamped stream into blocks.
+	while (length > 0)
+	{
+		if (decoder->block_offset == decoder->block.length) {
+			// Start of a new block; read its header.
+			if (!header_take(decoder, &data, &length, sizeof(struct block_header)))
+				return;
+			memcpy(&decoder->block, decoder->header, sizeof(struct block_header));
+			block_header_swap(&decoder->block);
+			decoder->block_offset = 0;
+		} else {
+			// Decode as much of the block's data as we have.
+			count = decoder->block.length - decoder->block_offset;
+			if (count > length)
+				count = length;
+			stream_feed(decoder, data, count);
+			decoder->block_offset += count;
+			data += count;
+			length -= count;
+		}
+	}
+}
+
+ssize_t decoder_read(struct decoder *decoder, int fd)
+{
+	ssize_t count = read(fd, decoder->read_buffer, READ_SIZE);
+	if (count > 0)
+		decoder_feed(decoder, decoder->read_buffer, count);
+	return count;
+}
+
+struct capture* decoder_snapshot(struct decoder *decoder)
+{
+	// Switch to any rebuilt capture that has caught up.
+	if (decoder->window && decoder->window->rebuild &&
+			rebuild_exchange(decoder->window, 0))
+		rebuild_finish(decoder);
+
+	// Finish decoding everything fed so far.
+	if (decoder->pipeline)
+		pipeline_flush(decoder->pipeline);
+
+	capture_publish(&decoder->context);
+	if (context_failed(&decoder->context))
+		return NULL;
+	return decoder->context.capture;
+}
+
+struct capture* decoder_close(struct decoder *decoder)
+{
+	struct context *context = &decoder->context;
+	struct capture *cap = context->capture;
+
+	// Finish decoding everything fed, and stop pipeline and rebuild threads.
+	if (decoder->pipeline)
+		pipeline_stop(decoder->pipeline);
+	if (decoder->window)
+		rebuild_cancel(decoder->window);
+
+	// End everything still in progress.
+	context_end(context);
+
+	// Store any remaining payload data as a final, shorter block.
+	if (context->data_pending_size > 0)
+		data_block_store(context);
+
+	// Map completed files as capture arrays.
+	capture_publish(context);
+	bool failed = context_failed(context);
+
+	// Close files and free memory used for decoding.
+	context_free(context);
+
+	// Free decoder.
+	if (decoder->trigger)
+		free(decoder->trigger->held);
+	free(decoder->trigger);
+	free(decoder->window);
+	free(decoder->read_buffer);
+	free(decoder);
+
+	// Give up on a capture with data missing.
+	if (failed) {
+		close_capture(cap);
+		return NULL;
+	}
+
+	return cap;
+}
+
+// Scanner for packet boundaries in an input file mapped into memory.
+struct scan {
+	// Contents of the file.
+	const uint8_t *data;
+	// Size of the file.
+	size_t size;
+	// Offset in the file of the next byte to scan.
+	size_t offset;
+	// Format of the stream in the file.
+	enum stream_format format;
+	// Header of the current block, in host byte order.
+	struct block_header block;
+	// Offset within the current block of the next byte of data.
+	uint64_t block_offset;
+};
+
+// A chunk of an input file, decoded independently of the rest.
+struct chunk {
+	// Contents of the chunk.
+	const uint8_t *data;
+	// Size of the chunk.
+	size_t length;
+	// Decoder for the chunk.
+	struct decoder *decoder;
+	// Thread decoding the chunk.
+	pthread_t thread;
+	// Whether the chunk is being decoded on its own thread.
+	bool threaded;
+	// Capture decoded from the chunk, holding its packets and data.
+	struct capture *capture;
+	// Records of transactions and packets in the chunk.
+	struct record *records;
+	// Number of records.
+	uint64_t num_records;
+};
+
+// Start scanning a file.
+static inline void scan_start(struct scan *scan, const uint8_t *data, size_t size)
+{
+	memset(scan, 0, sizeof(struct scan));
+	scan->data = data;
+	scan->size = size;
+	if (size >= LENGTH_SIZE && memcmp(data, STREAM_MAGIC, LENGTH_SIZE) == 0) {
+		scan->format = FORMAT_TIMESTAMPED;
+		scan->offset = STREAM_MAGIC_SIZE;
+	} else {
+		scan->format = FORMAT_RAW;
+	}
+}
+
+// Read bytes of raw stream data from the file, skipping any block headers.
+//
+// The bytes are skipped if buf is NULL. Returns false at end of file.
+static inline bool scan_read(struct scan *scan, uint8_t *buf, size_t length)
+{
+	bool timestamped = (scan->format == FORMAT_TIMESTAMPED);
+
+	while (length > 0)
+	{
+		if (timestamped && scan->block_offset == scan->block.length) {
+			// Start of a new block; read its header.
+			if (scan->offset + sizeof(struct block_header) > scan->size)
+				return false;
+			memcpy(&scan->block, &scan->data[scan->offset], sizeof(struct block_header));
+			block_header_swap(&scan->block);
+			scan->offset += sizeof(struct block_header);
+			scan->block_offset = 0;
+			continue;
+		}
+
+		size_t count = length;
+		if (timestamped && count > scan->block.length - scan->block_offset)
+			count = scan->block.length - scan->block_offset;
+		if (count > scan->size - scan->offset)
+			return false;
+		if (buf) {
+			memcpy(buf, &scan->data[scan->offset], count);
+			buf += count;
+		}
+		scan->offset += count;
+		scan->block_offset += count;
+		length -= count;
+	}
+
+	return true;
+}
+
+// Advance to the first packet starting at or after the target offset which
+// must begin a new transaction, so that decoding can be split there.
+//
+// Returns false, with the offset at the end of the file, if there is none.
+static bool scan_boundary(struct scan *scan, size_t target)
+{
+	uint8_t prefix[LENGTH_SIZE + 1];
+
+	while (true)
+	{
+		struct scan start = *scan;
+		if (!scan_read(scan, prefix, LENGTH_SIZE))
+			break;
+		uint16_t length = prefix[0] << 8 | prefix[1];
+		if (start.offset >= target && length > 0) {
+			// SETUP, IN and OUT always start a new transaction.
+			if (!scan_read(scan, &prefix[LENGTH_SIZE], 1))
+				break;
+			switch (prefix[LENGTH_SIZE])
+			{
+			case SETUP:
+			case IN:
+			case OUT:
+				*scan = start;
+				return true;
+			default:
+				length--;
+				break;
+			}
+		}
+		if (!scan_read(scan, NULL, length))
+			break;
+	}
+
+	scan->offset = scan->size;
+	return false;
+}
+
+// Decode a chunk, recording its transactions without decoding transfers.
+static void *chunk_decode(void *arg)
+{
+	struct chunk *chunk = arg;
+	struct decoder *decoder = chunk->decoder;
+	struct context *context = &decoder->context;
+
+	decoder_feed(decoder, chunk->data, chunk->length);
+
+	// End any transaction still ongoing, as the next chunk begins a new one.
+	transaction_end(context, false);
+
+	// Map records, then finish decoding.
+	chunk->num_records = context->records.count;
+	chunk->records = file_map(&context->records, chunk->num_records);
+	file_close(&context->records);
+	chunk->capture = decoder_close(decoder);
+
+	return NULL;
+}
+
+// Start decoding the next chunk of a file, from the scanner's position.
+//
+// Returns false if the chunk runs to the end of the file.
+static bool chunk_start(struct chunk *chunk, struct scan *scan)
+{
+	// Set up a decoder to start mid-stream at the current position.
+	struct decoder *decoder = chunk->decoder = decoder_open(0);
+
+	// Without a decoder, skip the chunk, leaving it to be merged as one
+	// which could not be decoded.
+	if (!decoder) {
+		chunk->threaded = false;
+		chunk->capture = NULL;
+		chunk->records = NULL;
+		chunk->num_records = 0;
+		return scan_boundary(scan, scan->offset + CHUNK_SIZE);
+	}
+
+	struct context *context = &decoder->context;
+	decoder->format = scan->format;
+	decoder->block = scan->block;
+	decoder->block_offset = scan->block_offset;
+	context->deferred = true;
+	context->records.name = "records";
+	context->records.item_size = sizeof(struct record);
+	file_open(&context->records);
+
+	// Find where the chunk ends.
+	size_t start = scan->offset;
+	bool more = scan_boundary(scan, start + CHUNK_SIZE);
+	chunk->data = &scan->data[start];
+	chunk->length = scan->offset - start;
+
+	// Decode on a new thread, or on this one if that is not possible.
+	chunk->threaded =
+		(pthread_create(&chunk->thread, NULL, chunk_decode, chunk) == 0);
+	if (!chunk->threaded)
+		chunk_decode(chunk);
+
+	return more;
+}
+
+// Wait for a chunk to be decoded, and then merge it into the main context.
+static void chunk_merge(struct context *context, struct chunk *chunk)
+{
+	if (chunk->threaded)
+		pthread_join(chunk->thread, NULL);
+
+	struct capture *cap = chunk->capture;
+
+	// A chunk which could not be decoded leaves the capture incomplete.
+	if (!cap) {
+		context->failed = true;
+		if (chunk->records)
+			munmap(chunk->records, chunk->num_records * sizeof(struct record));
+		return;
+	}
+	uint64_t packet_base = context->packet_pids.count;
+	uint64_t data_base = context->data_size;
+
+	// Write out packet columns.
+	file_write(&context->packet_pids, cap->packet_pids, cap->num_packets);
+	file_write(&context->packet_lengths, cap->packet_lengths, cap->num_packets);
+	file_write(&context->packet_fields, cap->packet_fields, cap->num_packets);
+
+	// Group packets and summarise them as a serial decode would, continuing
+	// the last group of the previous chunk, so that the stored checkpoints
+	// and time offsets do not depend on where chunks were split.
+	struct packet_checkpoint *checkpoint = &context->checkpoint;
+	uint64_t chunk_checkpoint = 0;
+	uint64_t data_offset = 0;
+	for (uint64_t i = 0; i < cap->num_packets; i++)
+	{
+		uint64_t id = packet_base + i;
+		uint8_t pid = cap->packet_pids[i];
+		uint16_t length = cap->packet_lengths[i];
+
+		// Recover the packet's timestamp from the chunk's own groups.
+		if (chunk_checkpoint + 1 < cap->num_checkpoints
+				&& cap->packet_checkpoints[chunk_checkpoint + 1].first_packet_id == i)
+			chunk_checkpoint++;
+		uint64_t timestamp_ns = cap->packet_checkpoints[chunk_checkpoint].timestamp_ns
+			+ cap->packet_time_offsets[i];
+		uint64_t time_offset = timestamp_ns - checkpoint->timestamp_ns;
+
+		if (id == 0 || id - checkpoint->first_packet_id == CHECKPOINT_INTERVAL
+				|| time_offset > UINT32_MAX) {
+			checkpoint->first_packet_id = id;
+			checkpoint->timestamp_ns = timestamp_ns;
+			checkpoint->data_offset = data_base + data_offset;
+			file_write(&context->packet_checkpoints, checkpoint, 1);
+			time_offset = 0;
+		}
+
+		uint32_t time_offset_32 = time_offset;
+		file_write(&context->packet_time_offsets, &time_offset_32, 1);
+		packet_summarize(context, id, pid,
+			(cap->packet_crc_errors[i / SUMMARY_BLOCK] >> (i % SUMMARY_BLOCK)) & 1);
+
+		data_offset += packet_data_length(length);
+	}
+
+	// Write out payload data.
+	data_write(context, cap->data, cap->data_size);
+
+	// Decode recorded transactions into transfers, in order.
+	for (uint64_t i = 0; i < chunk->num_records; i++)
+	{
+		struct record *rec = &chunk->records[i];
+		if (rec->type == TRANSACTION) {
+			context->current_transaction = rec->transaction;
+			context->current_transaction.first_packet_id += packet_base;
+			context->transaction_state = rec->state;
+			transaction_commit(context);
+		} else {
+			context->packet_id = packet_base + rec->transaction.first_packet_id;
+			event_create(context, PACKET);
+		}
+	}
+
+	// Leave no transaction in progress.
+	context->current_transaction.num_packets = 0;
+	memset(&context->transaction_state, 0, sizeof(struct transaction_state));
+
+	// Free chunk data.
+	if (chunk->num_records > 0)
+		munmap(chunk->records, chunk->num_records * sizeof(struct record));
+	close_capture(cap);
+}
+
+// Decode a large file in chunks, on as many threads as there are CPUs.
+//
+// Returns NULL if the file is not large enough to be worth splitting,
+// or cannot be mapped.
+static struct capture *convert_parallel(int fd)
+{
+	long num_workers = CHUNK_WORKERS;
+	struct stat st;
+
+	if (num_workers < 2 || fstat(fd, &st) != 0 || st.st_size < 2 * CHUNK_SIZE)
+		return NULL;
+
+	const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	struct decoder *decoder = decoder_open(0);
+	if (!decoder) {
+		munmap((void *) data, st.st_size);
+		return NULL;
+	}
+	struct chunk chunks[num_workers];
+	struct scan scan;
+	uint64_t started = 0, merged = 0;
+	bool more = true;
+
+	scan_start(&scan, data, st.st_size);
+
+	// Keep every worker busy, merging chunks in order as they finish.
+	while (more || merged < started)
+	{
+		while (more && started - merged < num_workers)
+			more = chunk_start(&chunks[started++ % num_workers], &scan);
+		chunk_merge(&decoder->context, &chunks[merged++ % num_workers]);
+	}
+
+	munmap((void *) data, st.st_size);
+
+	return decoder_close(decoder);
+}
+
+struct capture* convert_capture(const char *filename)
+{
+	// Open input file
+	int fd = open(filename, O_RDONLY);
+
+	// Decode large files in parallel where possible.
+	struct capture *cap = convert_parallel(fd);
+
+	// Otherwise, decode input until end of file.
+	if (!cap) {
+		struct decoder *decoder = decoder_open(DECODER_PIPELINED);
+		if (decoder) {
+			while (decoder_read(decoder, fd) > 0);
+			cap = decoder_close(decoder);
+		}
+	}
+
+	// Close input file.
+	close(fd);
+
+	return cap;
+}
+
+int save_capture(struct capture *cap, const char *filename)
+{
+	size_t num_arrays;
+	struct capture_array *arrays = capture_arrays(cap, &num_arrays);
+	struct file_header header = {
+		.magic = CAPTURE_MAGIC,
+		.version = CAPTURE_VERSION,
+		.num_sections = num_arrays,
+	};
+	size_t table_size = num_arrays * sizeof(struct file_section);
+	struct file_section *sections = malloc(table_size);
+	if (!arrays || !sections) {
+		free(arrays);
+		free(sections);
+		return -1;
+	}
+
+	// Lay out sections, each aligned for mapping.
+	uint64_t offset = sizeof(header) + table_size;
+	for (int i = 0; i < num_arrays; i++) {
+		offset = (offset + SECTION_ALIGN - 1) & ~(SECTION_ALIGN - 1);
+		sections[i].offset = offset;
+		sections[i].length = *arrays[i].count * arrays[i].item_size;
+		sections[i].item_size = arrays[i].item_size;
+		offset += sections[i].length;
+	}
+
+	FILE *file = fopen(filename, "w");
+	if (!file) {
+		free(arrays);
+		free(sections);
+		return -1;
+	}
+
+	// Write header and section table, then each array at its offset.
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(sections, table_size, 1, file) == 1;
+	for (int i = 0; written && i < num_arrays; i++) {
+		if (sections[i].length == 0)
+			continue;
+		written = fseek(file, sections[i].offset, SEEK_SET) == 0
+			&& fwrite(*arrays[i].data, sections[i].length, 1, file) == 1;
+	}
+
+	free(arrays);
+	free(sections);
+
+	return (fclose(file) == 0 && written) ? 0 : -1;
+}
+
+struct capture* load_capture(const char *filename)
+{
+	struct file_header header;
+	struct stat st;
+
+	// Open file and check header.
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (read(fd, &header, sizeof(header)) < sizeof(header)
+			|| memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != CAPTURE_VERSION
+			|| header.num_sections < MAIN_ARRAYS
+			|| (header.num_sections - MAIN_ARRAYS) % ENDPOINT_ARRAYS != 0
+			|| fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	// Read section table, which must fit in the file.
+	if (header.num_sections > (st.st_size - sizeof(header)) / sizeof(struct file_section)) {
+		close(fd);
+		return NULL;
+	}
+	size_t table_size = header.num_sections * sizeof(struct file_section);
+	struct file_section *sections = malloc(table_size);
+	struct capture *cap = calloc(1, sizeof(struct capture));
+	if (!sections || !cap || read(fd, sections, table_size) < table_size) {
+		free(sections);
+		free(cap);
+		close(fd);
+		return NULL;
+	}
+
+	// Allocate per-endpoint traffic records.
+	bool valid = true;
+	cap->num_endpoints = (header.num_sections - MAIN_ARRAYS) / ENDPOINT_ARRAYS;
+	cap->endpoint_traffic = calloc(cap->num_endpoints, sizeof(struct endpoint_traffic *));
+	if (!cap->endpoint_traffic) {
+		cap->num_endpoints = 0;
+		valid = false;
+	}
+	for (int i = 0; valid && i < cap->num_endpoints; i++) {
+		cap->endpoint_traffic[i] = calloc(1, sizeof(struct endpoint_traffic));
+		if (!cap->endpoint_traffic[i]) {
+			cap->num_endpoints = i;
+			valid = false;
+		}
+	}
+
+	// Map each section as a capture array.
+	size_t num_arrays;
+	struct capture_array *arrays = valid ? capture_arrays(cap, &num_arrays) : NULL;
+	if (!arrays) {
+		free(sections);
+		close(fd);
+		close_capture(cap);
+		return NULL;
+	}
+	for (int i = 0; i < num_arrays; i++) {
+		struct file_section *section = &sections[i];
+		// Sections hold whole items, within the file. Empty sections at
+		// the end of the file may lie beyond it.
+		if (section->item_size != arrays[i].item_size
+				|| section->offset % SECTION_ALIGN != 0
+				|| section->length % section->item_size != 0
+				|| (section->length > 0
+					&& (section->offset > st.st_size
+						|| section->length > st.st_size - section->offset))) {
+			valid = false;
+			continue;
+		}
+		// Arrays sharing a count, which are listed together, must agree,
+		// and there must be an endpoint for each set of endpoint sections.
+		uint64_t count = section->length / section->item_size;
+		if ((i > 0 && arrays[i].count == arrays[i - 1].count && count != *arrays[i].count)
+				|| (arrays[i].count == &cap->num_endpoints && count != cap->num_endpoints)) {
+			valid = false;
+			continue;
+		}
+		*arrays[i].count = count;
+		if (section->length > 0) {
+			void *data = mmap(NULL, section->length,
+				PROT_READ, MAP_SHARED, fd, section->offset);
+			if (data == MAP_FAILED)
+				valid = false;
+			else
+				*arrays[i].data = data;
+		}
+	}
+
+	free(arrays);
+	free(sections);
+	close(fd);
+
+	if (!valid) {
+		close_capture(cap);
+		return NULL;
+	}
+
+	// Find the size of the payload data, which if compressed is given by
+	// the number of blocks and the length of the last.
+	if (cap->num_data_blocks > 0)
+		cap->data_size = (cap->num_data_blocks - 1) * DATA_BLOCK_SIZE
+			+ cap->data_blocks[cap->num_data_blocks - 1].length;
+	else
+		cap->data_size = cap->data_stored_size;
+
+	return cap;
+}
+
+void capture_packet(struct capture *cap, uint64_t id, struct packet *pkt)
+{
+	// Find the group containing the packet. Groups hold at most
+	// CHECKPOINT_INTERVAL packets, so it cannot be earlier than this.
+	uint64_t lo = id / CHECKPOINT_INTERVAL;
+	uint64_t hi = cap->num_checkpoints < id + 1 ? cap->num_checkpoints : id + 1;
+	while (hi - lo > 1) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (cap->packet_checkpoints[mid].first_packet_id <= id)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	struct packet_checkpoint *checkpoint = &cap->packet_checkpoints[lo];
+
+	// Fill in fields from columns.
+	pkt->timestamp_ns = checkpoint->timestamp_ns + cap->packet_time_offsets[id];
+	pkt->length = cap->packet_lengths[id];
+	pkt->pid = cap->packet_pids[id];
+	memcpy(&pkt->fields, &cap->packet_fields[id], sizeof(pkt->fields));
+	pkt->crc_error = (cap->packet_crc_errors[id / SUMMARY_BLOCK] >> (id % SUMMARY_BLOCK)) & 1;
+
+	// Find payload offset, from those of earlier packets in the group.
+	pkt->data_offset = 0;
+	if (packet_has_data(pkt->pid, pkt->length) || packet_data_length(pkt->length)) {
+		pkt->data_offset = checkpoint->data_offset;
+		for (uint64_t i = checkpoint->first_packet_id; i < id; i++)
+			pkt->data_offset += packet_data_length(cap->packet_lengths[i]);
+	}
+}
+
+uint64_t capture_packet_at(struct capture *cap, uint64_t timestamp_ns)
+{
+	// Find the first checkpoint at or after the time.
+	uint64_t lo = 0, hi = cap->num_checkpoints;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (cap->packet_checkpoints[mid].timestamp_ns < timestamp_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// Its first packet is the answer, unless one in the previous group is.
+	uint64_t end = (lo < cap->num_checkpoints) ?
+		cap->packet_checkpoints[lo].first_packet_id : cap->num_packets;
+	if (lo > 0) {
+		struct packet_checkpoint *checkpoint = &cap->packet_checkpoints[lo - 1];
+		for (uint64_t id = checkpoint->first_packet_id; id < end; id++)
+			if (checkpoint->timestamp_ns + cap->packet_time_offsets[id] >= timestamp_ns)
+				return id;
+	}
+
+	return end;
+}
+
+uint64_t capture_transaction_at(struct capture *cap, uint64_t timestamp_ns)
+{
+	uint64_t packet_id = capture_packet_at(cap, timestamp_ns);
+
+	// Find the first transaction starting at or after that packet.
+	uint64_t lo = 0, hi = cap->num_transactions;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (cap->transactions[mid].first_packet_id < packet_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Find the ID of the first packet in an event.
+static inline uint64_t event_first_packet(struct capture *cap, struct event *evt)
+{
+	switch (evt->type)
+	{
+	case PACKET:
+		return evt->id;
+	case TRANSACTION:
+		return cap->transactions[evt->id].first_packet_id;
+	default:
+		{
+			struct transfer_index_entry *entry = &cap->transfer_index[evt->id];
+			struct endpoint_traffic *ep_traf = cap->endpoint_traffic[entry->endpoint_id];
+			struct transfer *xfer = &ep_traf->transfers[entry->transfer_id];
+			uint64_t transaction_id = ep_traf->transaction_ids[xfer->ep_tran_offset];
+			return cap->transactions[transaction_id].first_packet_id;
+		}
+	}
+}
+
+// Find the first event starting at or after a packet.
+//
+// Events are created in the order of their first packets, so this is a
+// binary search.
+static uint64_t event_search(struct capture *cap, uint64_t packet_id)
+{
+	uint64_t lo = 0, hi = cap->num_events;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (event_first_packet(cap, &cap->events[mid]) < packet_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+uint64_t capture_event_at(struct capture *cap, uint64_t timestamp_ns)
+{
+	return event_search(cap, capture_packet_at(cap, timestamp_ns));
+}
+
+uint64_t capture_packet_transaction(struct capture *cap, uint64_t packet_id)
+{
+	// Find the last transaction starting at or before the packet.
+	uint64_t lo = 0, hi = cap->num_transactions;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (cap->transactions[mid].first_packet_id <= packet_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// Check that the packet is within it.
+	if (lo > 0) {
+		struct transaction *tran = &cap->transactions[lo - 1];
+		if (packet_id < tran->first_packet_id + tran->num_packets)
+			return lo - 1;
+	}
+
+	return cap->num_transactions;
+}
+
+uint64_t capture_packet_event(struct capture *cap, uint64_t packet_id)
+{
+	// A packet in a transaction is in the transaction's event.
+	uint64_t transaction_id = capture_packet_transaction(cap, packet_id);
+	if (transaction_id < cap->num_transactions)
+		return cap->transaction_events[transaction_id];
+
+	// Otherwise, it may have an event of its own.
+	uint64_t event_id = event_search(cap, packet_id);
+	if (event_id < cap->num_events
+			&& cap->events[event_id].type == PACKET
+			&& cap->events[event_id].id == packet_id)
+		return event_id;
+
+	return cap->num_events;
+}
+
+uint64_t capture_transaction_position(struct capture *cap, uint64_t transaction_id)
+{
+	struct event *evt = &cap->events[cap->transaction_events[transaction_id]];
+
+	if (evt->type != TRANSFER)
+		return 0;
+
+	// Transaction IDs within a transfer are in increasing order.
+	struct transfer_index_entry *entry = &cap->transfer_index[evt->id];
+	struct endpoint_traffic *ep_traf = cap->endpoint_traffic[entry->endpoint_id];
+	struct transfer *xfer = &ep_traf->transfers[entry->transfer_id];
+	uint64_t *ids = &ep_traf->transaction_ids[xfer->ep_tran_offset];
+	uint64_t lo = 0, hi = xfer->num_transactions;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (ids[mid] < transaction_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+uint64_t capture_packet_run(struct capture *cap, uint64_t packet_id)
+{
+	uint64_t lo = 0, hi = cap->num_poll_runs;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (cap->poll_runs[mid].packet_id < packet_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < cap->num_poll_runs && cap->poll_runs[lo].packet_id == packet_id)
+		return lo;
+
+	return cap->num_poll_runs;
+}
+
+void capture_run_poll(struct capture *cap, uint64_t run_id, uint64_t n,
+	struct packet *token, struct packet *handshake)
+{
+	struct poll_run *run = &cap->poll_runs[run_id];
+
+	// Repeats are the same as the poll stored before them.
+	capture_packet(cap, run->packet_id, token);
+	capture_packet(cap, run->packet_id + 1, handshake);
+
+	uint64_t timestamp_ns = run->first_timestamp_ns;
+	if (run->count > 1)
+		timestamp_ns += (uint64_t) ((run->last_timestamp_ns - run->first_timestamp_ns) *
+			(double) n / (run->count - 1));
+	token->timestamp_ns = timestamp_ns;
+	handshake->timestamp_ns = timestamp_ns;
+}
+
+// Get the contents of a block of payload data, decompressing it into the
+// capture's cache if necessary. Returns NULL if the block is invalid.
+static const uint8_t *data_block_get(struct capture *cap, uint64_t index)
+{
+	struct data_block *block = &cap->data_blocks[index];
+
+	if (block->offset + block->stored_length > cap->data_stored_size
+			|| block->length > DATA_BLOCK_SIZE)
+		return NULL;
+
+	// Uncompressed blocks are used directly.
+	if (block->stored_length == block->length)
+		return &cap->data[block->offset];
+
+	if (!cap->data_cache)
+		cap->data_cache = calloc(1, sizeof(struct data_cache));
+
+	// Look for the block in the cache, noting the least recently used.
+	struct data_cache *cache = cap->data_cache;
+	struct cached_block *oldest = &cache->blocks[0];
+	cache->clock++;
+	for (int i = 0; i < DATA_CACHE_BLOCKS; i++) {
+		struct cached_block *cached = &cache->blocks[i];
+		if (cached->last_used != 0 && cached->index == index) {
+			cached->last_used = cache->clock;
+			return cached->data;
+		}
+		if (cached->last_used < oldest->last_used)
+			oldest = cached;
+	}
+
+	// Decompress the block in place of the least recently used one.
+	oldest->last_used = 0;
+	if (!block_decompress(&cap->data[block->offset], block->stored_length,
+			oldest->data, block->length))
+		return NULL;
+	oldest->index = index;
+	oldest->last_used = cache->clock;
+
+	return oldest->data;
+}
+
+void capture_data(struct capture *cap, uint64_t offset, uint64_t length, uint8_t *buf)
+{
+	while (length > 0)
+	{
+		const uint8_t *src = NULL;
+		uint64_t count = length;
+
+		// Find the bytes available from the offset onwards, if any.
+		if (cap->num_data_blocks == 0) {
+			if (offset < cap->data_stored_size) {
+				src = &cap->data[offset];
+				if (count > cap->data_stored_size - offset)
+					count = cap->data_stored_size - offset;
+			}
+		} else {
+			uint64_t index = offset / DATA_BLOCK_SIZE;
+			uint64_t start = offset % DATA_BLOCK_SIZE;
+			if (index < cap->num_data_blocks && start < cap->data_blocks[index].length) {
+				src = data_block_get(cap, index);
+				if (src)
+					src += start;
+				if (count > cap->data_blocks[index].length - start)
+					count = cap->data_blocks[index].length - start;
+			}
+		}
+
+		// Copy them, or zeroes if there are none.
+		if (src)
+			memcpy(buf, src, count);
+		else
+			memset(buf, 0, count);
+
+		buf += count;
+		offset += count;
+		length -= count;
+	}
+}
+
+// Create an empty view of a number of items.
+//
+// Returns NULL if memory could not be allocated.
+static struct filter_view *view_create(uint64_t num_items)
+{
+	struct filter_view *view = calloc(1, sizeof(struct filter_view));
+	if (!view)
+		return NULL;
+	view->num_items = num_items;
+	view->num_words = (num_items + 63) / 64;
+	view->num_blocks = (view->num_words + RANK_BLOCK_WORDS - 1) / RANK_BLOCK_WORDS;
+	view->bits = calloc(view->num_blocks * RANK_BLOCK_WORDS, sizeof(uint64_t));
+	if (!view->bits) {
+		free(view);
+		return NULL;
+	}
+	return view;
+}
+
+// Build the rank and select indexes of a view, once its bitmap is complete.
+//
+// Returns false if memory could not be allocated.
+static bool view_index(struct filter_view *view)
+{
+	view->ranks = malloc((view->num_blocks + 1) * sizeof(uint64_t));
+	if (!view->ranks)
+		return false;
+	view->count = 0;
+	for (uint64_t block = 0; block < view->num_blocks; block++) {
+		view->ranks[block] = view->count;
+		for (int i = 0; i < RANK_BLOCK_WORDS; i++)
+			view->count += __builtin_popcountll(view->bits[block * RANK_BLOCK_WORDS + i]);
+	}
+	view->ranks[view->num_blocks] = view->count;
+
+	uint64_t num_samples = (view->count + SELECT_SAMPLE - 1) / SELECT_SAMPLE;
+	view->samples = malloc((num_samples + 1) * sizeof(uint64_t));
+	if (!view->samples)
+		return false;
+	uint64_t sample = 0;
+	for (uint64_t block = 0; block < view->num_blocks; block++)
+		while (sample < num_samples && sample * SELECT_SAMPLE < view->ranks[block + 1])
+			view->samples[sample++] = block;
+	view->samples[num_samples] = view->num_blocks;
+	return true;
+}
+
+// Whether a block summary has any values accepted by a filter.
+static inline bool filter_overlaps(struct filter *filter, struct filter *summary)
+{
+	return (!(filter->addresses[0] | filter->addresses[1])
+			|| (filter->addresses[0] & summary->addresses[0])
+			|| (filter->addresses[1] & summary->addresses[1]))
+		&& (!filter->endpoints || (filter->endpoints & summary->endpoints))
+		&& (!filter->pids || (filter->pids & summary->pids))
+		&& (!filter->results || (filter->results & summary->results));
+}
+
+// Whether a transaction is accepted by a filter.
+static inline bool filter_transaction(struct capture *cap, struct filter *filter, uint64_t id)
+{
+	struct transaction *tran = &cap->transactions[id];
+	uint8_t first = cap->packet_pids[tran->first_packet_id];
+	uint8_t last = cap->packet_pids[tran->first_packet_id + tran->num_packets - 1];
+
+	if ((filter->pids && !(filter->pids & (1 << (first & PID_MASK))))
+			|| (filter->results && !(filter->results & (1 << (last & PID_MASK)))))
+		return false;
+
+	if (!(filter->addresses[0] | filter->addresses[1] | filter->endpoints))
+		return true;
+
+	// Only transactions beginning with a token have an address and endpoint.
+	if (first == SOF)
+		return false;
+	uint16_t fields = cap->packet_fields[tran->first_packet_id];
+	uint8_t address = fields & 0x7F;
+	uint8_t endpoint_num = (fields >> 7) & 0x0F;
+
+	return (!(filter->addresses[0] | filter->addresses[1])
+			|| (filter->addresses[address / 64] & (1ULL << (address % 64))))
+		&& (!filter->endpoints || (filter->endpoints & (1 << endpoint_num)));
+}
+
+struct filter_view *filter_transactions(struct capture *cap, struct filter *filter)
+{
+	struct filter_view *view = view_create(cap->num_transactions);
+	if (!view)
+		return NULL;
+
+	// Check each transaction in blocks whose summaries overlap the filter.
+	// The last block may be incomplete, and not yet summarised.
+	for (uint64_t word = 0; word < view->num_words; word++)
+	{
+		if (word < cap->num_transaction_summaries
+				&& !filter_overlaps(filter, &cap->transaction_summaries[word]))
+			continue;
+		uint64_t start = word * 64;
+		uint64_t end = start + 64 < view->num_items ? start + 64 : view->num_items;
+		uint64_t bits = 0;
+		for (uint64_t id = start; id < end; id++)
+			if (filter_transaction(cap, filter, id))
+				bits |= 1ULL << (id - start);
+		view->bits[word] = bits;
+	}
+
+	if (!view_index(view)) {
+		view_close(view);
+		return NULL;
+	}
+	return view;
+}
+
+struct filter_view *filter_packets(struct capture *cap, struct filter *filter)
+{
+	struct filter_view *view = view_create(cap->num_packets);
+	uint16_t pids = filter->pids;
+	if (!view)
+		return NULL;
+
+	if (!(filter->addresses[0] | filter->addresses[1] | filter->endpoints | filter->results)) {
+		// Filter on PID alone, checking packets in blocks whose summaries
+		// include any of the PIDs.
+		for (uint64_t word = 0; word < view->num_words; word++)
+		{
+			if (pids && word < cap->num_packet_summaries
+					&& !(pids & cap->packet_summaries[word]))
+				continue;
+			uint64_t start = word * 64;
+			uint64_t end = start + 64 < view->num_items ? start + 64 : view->num_items;
+			uint64_t bits = 0;
+			for (uint64_t id = start; id < end; id++)
+				if (!pids || (pids & (1 << (cap->packet_pids[id] & PID_MASK))))
+					bits |= 1ULL << (id - start);
+			view->bits[word] = bits;
+		}
+	} else {
+		// Find the transactions matching on everything but PID, then
+		// select their packets which match on PID.
+		struct filter transaction_filter = *filter;
+		transaction_filter.pids = 0;
+		struct filter_view *transactions = filter_transactions(cap, &transaction_filter);
+		if (!transactions) {
+			view_close(view);
+			return NULL;
+		}
+		for (uint64_t word = 0; word < transactions->num_words; word++)
+		{
+			uint64_t bits = transactions->bits[word];
+			while (bits) {
+				struct transaction *tran = &cap->transactions[word * 64 + __builtin_ctzll(bits)];
+				uint64_t end = tran->first_packet_id + tran->num_packets;
+				for (uint64_t id = tran->first_packet_id; id < end && id < view->num_items; id++)
+					if (!pids || (pids & (1 << (cap->packet_pids[id] & PID_MASK))))
+						view->bits[id / 64] |= 1ULL << (id % 64);
+				bits &= bits - 1;
+			}
+		}
+		view_close(transactions);
+	}
+
+	if (!view_index(view)) {
+		view_close(view);
+		return NULL;
+	}
+	return view;
+}
+
+uint64_t view_count(struct filter_view *view)
+{
+	return view->count;
+}
+
+uint64_t view_select(struct filter_view *view, uint64_t n)
+{
+	if (n >= view->count)
+		return view->num_items;
+
+	// Find the last block with fewer than n items selected before it,
+	// between those holding the samples either side of the item.
+	uint64_t lo = view->samples[n / SELECT_SAMPLE];
+	uint64_t hi = view->samples[n / SELECT_SAMPLE + 1] + 1;
+	if (hi > view->num_blocks)
+		hi = view->num_blocks;
+	while (hi - lo > 1) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (view->ranks[mid] <= n)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	// Find the word, then the bit, holding the item.
+	uint64_t remaining = n - view->ranks[lo];
+	uint64_t word = lo * RANK_BLOCK_WORDS;
+	uint64_t bits = view->bits[word];
+	while (remaining >= __builtin_popcountll(bits)) {
+		remaining -= __builtin_popcountll(bits);
+		bits = view->bits[++word];
+	}
+	while (remaining-- > 0)
+		bits &= bits - 1;
+
+	return word * 64 + __builtin_ctzll(bits);
+}
+
+uint64_t view_rank(struct filter_view *view, uint64_t id)
+{
+	if (id >= view->num_items)
+		return view->count;
+
+	uint64_t word = id / 64;
+	uint64_t block = word / RANK_BLOCK_WORDS;
+	uint64_t rank = view->ranks[block];
+	for (uint64_t i = block * RANK_BLOCK_WORDS; i < word; i++)
+		rank += __builtin_popcountll(view->bits[i]);
+	rank += __builtin_popcountll(view->bits[word] & ((1ULL << (id % 64)) - 1));
+
+	return rank;
+}
+
+void view_close(struct filter_view *view)
+{
+	free(view->bits);
+	free(view->ranks);
+	free(view->samples);
+	free(view);
+}
+
+// Key of an item in a sort index.
+static inline uint64_t sort_key_value(struct sort_index *index, uint64_t id)
+{
+	struct capture *cap = index->cap;
+
+	if (index->transfers) {
+		struct transfer_index_entry *entry = &cap->transfer_index[id];
+		struct endpoint_traffic *traf = cap->endpoint_traffic[entry->endpoint_id];
+		struct endpoint *ep = &cap->endpoints[entry->endpoint_id];
+		switch (index->key)
+		{
+		case SORT_DURATION:
+			return traf->transfer_info[entry->transfer_id].duration_ns;
+		case SORT_DATA_LENGTH:
+			return traf->transfer_info[entry->transfer_id].data_length;
+		case SORT_RESULT:
+			return traf->transfers[entry->transfer_id].complete;
+		case SORT_ENDPOINT:
+			return ep->address << 4 | ep->endpoint_num;
+		}
+	} else {
+		struct transaction_info *info = &cap->transaction_info[id];
+		switch (index->key)
+		{
+		case SORT_DURATION:
+			return info->duration_ns;
+		case SORT_DATA_LENGTH:
+			return info->data_length;
+		case SORT_RESULT:
+			return (uint64_t) cap->transactions[id].complete << 8 | info->result;
+		case SORT_ENDPOINT:
+			// SOF transactions, having no endpoint, come after all others.
+			if (info->type == SOF)
+				return 1 << 11;
+			return info->address << 4 | info->endpoint_num;
+		}
+	}
+
+	return 0;
+}
+
+// Whether one entry comes before another, by key and then by ID.
+static inline bool sort_before(struct sort_entry *a, struct sort_entry *b)
+{
+	return a->key < b->key || (a->key == b->key && a->id < b->id);
+}
+
+// Look up the keys of a range of entries, then sort it by key with a
+// radix sort, keeping entries with equal keys in their existing order.
+// Only the bytes in which keys differ are sorted on.
+static void *sort_part_radix(void *arg)
+{
+	struct sort_part *part = arg;
+	struct sort_entry *src = part->entries, *dest = part->scratch;
+	uint64_t count = part->count;
+
+	uint64_t differ = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		src[i].key = sort_key_value(part->index, src[i].id);
+		differ |= src[i].key ^ src[0].key;
+	}
+
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		if (((differ >> shift) & 0xFF) == 0)
+			continue;
+
+		// Find where entries with each value of this byte begin.
+		uint64_t offsets[256] = { 0 };
+		for (uint64_t i = 0; i < count; i++)
+			offsets[(src[i].key >> shift) & 0xFF]++;
+		uint64_t total = 0;
+		for (int value = 0; value < 256; value++) {
+			uint64_t num_entries = offsets[value];
+			offsets[value] = total;
+			total += num_entries;
+		}
+
+		// Move entries to their places, then sort on the next byte from there.
+		for (uint64_t i = 0; i < count; i++)
+			dest[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+		struct sort_entry *sorted = dest;
+		dest = src;
+		src = sorted;
+	}
+
+	if (src != part->entries)
+		memcpy(part->entries, src, count * sizeof(struct sort_entry));
+
+	return NULL;
+}
+
+// Merge the two sorted runs making up a range of entries into its
+// scratch space.
+static void *sort_part_merge(void *arg)
+{
+	struct sort_part *part = arg;
+	struct sort_entry *a = part->entries, *a_end = &part->entries[part->split];
+	struct sort_entry *b = a_end, *b_end = &part->entries[part->count];
+	struct sort_entry *dest = part->scratch;
+
+	while (a < a_end && b < b_end)
+		*dest++ = sort_before(b, a) ? *b++ : *a++;
+	memcpy(dest, a, (a_end - a) * sizeof(struct sort_entry));
+	dest += a_end - a;
+	memcpy(dest, b, (b_end - b) * sizeof(struct sort_entry));
+
+	return NULL;
+}
+
+// Run a function on each of a number of parts, each on a new thread if
+// there is more than one and threads can be started, and wait for all.
+static void sort_parts_run(struct sort_part *parts, int num_parts, void *(*function)(void *))
+{
+	for (int i = 0; i < num_parts; i++) {
+		parts[i].threaded = num_parts > 1 &&
+			(pthread_create(&parts[i].thread, NULL, function, &parts[i]) == 0);
+		if (!parts[i].threaded)
+			function(&parts[i]);
+	}
+
+	for (int i = 0; i < num_parts; i++)
+		if (parts[i].threaded)
+			pthread_join(parts[i].thread, NULL);
+}
+
+// Sort entries, which must be in order of ID, by key and then by ID.
+//
+// Large numbers of entries are split into a range for each CPU, each
+// sorted on its own thread, and pairs of sorted ranges are then merged,
+// also in parallel, until one remains.
+//
+// Returns false, leaving the entries as they were, if memory cannot be
+// allocated.
+static bool sort_entries(struct sort_index *index, struct sort_entry *entries, uint64_t count)
+{
+	long num_parts = count < SORT_PARALLEL_MIN ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_parts < 1)
+		num_parts = 1;
+
+	struct sort_entry *scratch = malloc((count + 1) * sizeof(struct sort_entry));
+	struct sort_part *parts = malloc(num_parts * sizeof(struct sort_part));
+	uint64_t *bounds = malloc((num_parts + 1) * sizeof(uint64_t));
+	if (!scratch || !parts || !bounds) {
+		free(scratch);
+		free(parts);
+		free(bounds);
+		return false;
+	}
+
+	// Sort each range.
+	for (int i = 0; i <= num_parts; i++)
+		bounds[i] = count * i / num_parts;
+	for (int i = 0; i < num_parts; i++)
+		parts[i] = (struct sort_part) {
+			.index = index,
+			.entries = &entries[bounds[i]],
+			.scratch = &scratch[bounds[i]],
+			.count = bounds[i + 1] - bounds[i],
+		};
+	sort_parts_run(parts, num_parts, sort_part_radix);
+
+	// Merge pairs of sorted runs, moving between the two buffers. A
+	// final run without a partner is merged with nothing, and so copied.
+	struct sort_entry *src = entries, *dest = scratch;
+	int num_runs = num_parts;
+	while (num_runs > 1)
+	{
+		int num_merges = (num_runs + 1) / 2;
+		for (int i = 0; i < num_merges; i++) {
+			int first = 2 * i;
+			int end = first + 2 < num_runs ? first + 2 : num_runs;
+			parts[i] = (struct sort_part) {
+				.index = index,
+				.entries = &src[bounds[first]],
+				.scratch = &dest[bounds[first]],
+				.count = bounds[end] - bounds[first],
+				.split = bounds[first + 1] - bounds[first],
+			};
+		}
+		sort_parts_run(parts, num_merges, sort_part_merge);
+
+		for (int i = 0; i <= num_merges; i++)
+			bounds[i] = bounds[2 * i < num_runs ? 2 * i : num_runs];
+		num_runs = num_merges;
+		struct sort_entry *merged = dest;
+		dest = src;
+		src = merged;
+	}
+
+	if (src != entries)
+		memcpy(entries, src, count * sizeof(struct sort_entry));
+	free(scratch);
+	free(parts);
+	free(bounds);
+	return true;
+}
+
+// Make room in an index for a number of items, and for an item pending
+// on each endpoint of its capture.
+//
+// Returns false if memory cannot be allocated.
+static bool sort_reserve(struct sort_index *index, uint64_t count)
+{
+	if (count > index->capacity) {
+		uint64_t capacity = count > 2 * index->capacity ? count : 2 * index->capacity;
+		struct sort_entry *entries =
+			realloc(index->entries, capacity * sizeof(struct sort_entry));
+		if (!entries)
+			return false;
+		index->entries = entries;
+		index->capacity = capacity;
+	}
+
+	struct sort_entry *pending = realloc(index->pending,
+		(index->cap->num_endpoints + 1) * sizeof(struct sort_entry));
+	if (!pending)
+		return false;
+	index->pending = pending;
+	return true;
+}
+
+// Note the last transfer on each endpoint if it is incomplete, as it may
+// still be in progress, in which case its key may yet change.
+static void sort_pending_find(struct sort_index *index)
+{
+	struct capture *cap = index->cap;
+	uint64_t remaining = 0;
+
+	index->num_pending = 0;
+	if (!index->transfers || index->selected)
+		return;
+
+	for (int i = 0; i < cap->num_endpoints; i++) {
+		struct endpoint_traffic *traf = cap->endpoint_traffic[i];
+		if (traf->num_transfers > 0 && !traf->transfers[traf->num_transfers - 1].complete)
+			remaining++;
+	}
+
+	// Search back from the end of the transfer index, which is in order of
+	// the transfers starting, for the last transfer on each endpoint.
+	for (uint64_t id = index->num_items; remaining > 0 && id-- > 0;) {
+		struct transfer_index_entry *entry = &cap->transfer_index[id];
+		struct endpoint_traffic *traf = cap->endpoint_traffic[entry->endpoint_id];
+		if (entry->transfer_id == traf->num_transfers - 1
+				&& !traf->transfers[entry->transfer_id].complete) {
+			index->pending[index->num_pending++] =
+				(struct sort_entry) { sort_key_value(index, id), id };
+			remaining--;
+		}
+	}
+
+	// Put them in ascending order.
+	for (uint64_t i = 0; i < index->num_pending / 2; i++) {
+		struct sort_entry entry = index->pending[i];
+		index->pending[i] = index->pending[index->num_pending - 1 - i];
+		index->pending[index->num_pending - 1 - i] = entry;
+	}
+}
+
+// Whether an item was noted as pending when its index was last sorted.
+static inline bool sort_pending(struct sort_index *index, uint64_t id)
+{
+	uint64_t lo = 0, hi = index->num_pending;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (index->pending[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < index->num_pending && index->pending[lo].id == id;
+}
+
+// Position in a sort index of the first item not sorted before an entry.
+static inline uint64_t sort_position(struct sort_index *index, struct sort_entry *entry)
+{
+	uint64_t lo = 0, hi = index->count;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (sort_before(&index->entries[mid], entry))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Number of items of the kind sorted by an index in its capture.
+static inline uint64_t sort_num_items(struct sort_index *index)
+{
+	return index->transfers ? index->cap->num_transfers : index->cap->num_transactions;
+}
+
+// Sort all the items in a capture, or those selected by a view.
+//
+// Returns false, leaving the index as it was, if memory cannot be allocated.
+static bool sort_build(struct sort_index *index, struct filter_view *view)
+{
+	struct capture *cap = index->cap;
+	uint64_t num_items = sort_num_items(index);
+	uint64_t count = view ? view->count : num_items;
+	struct sort_entry *entries = malloc((count + 1) * sizeof(struct sort_entry));
+	if (!entries || !sort_reserve(index, 0)) {
+		free(entries);
+		return false;
+	}
+
+	if (view) {
+		uint64_t n = 0;
+		for (uint64_t word = 0; word < view->num_words; word++)
+			for (uint64_t bits = view->bits[word]; bits; bits &= bits - 1)
+				entries[n++].id = word * 64 + __builtin_ctzll(bits);
+	} else {
+		for (uint64_t i = 0; i < count; i++)
+			entries[i].id = i;
+	}
+
+	if (!sort_entries(index, entries, count)) {
+		free(entries);
+		return false;
+	}
+
+	free(index->entries);
+	index->entries = entries;
+	index->capacity = count + 1;
+	index->count = count;
+	index->num_items = num_items;
+	index->generation = cap->window_generation;
+	sort_pending_find(index);
+	return true;
+}
+
+// Create a sort index, and sort the items in it.
+static struct sort_index *sort_create(struct capture *cap, bool transfers,
+	struct filter_view *view, enum sort_key key)
+{
+	struct sort_index *index = calloc(1, sizeof(struct sort_index));
+	if (!index)
+		return NULL;
+	index->cap = cap;
+	index->transfers = transfers;
+	index->key = key;
+	index->selected = (view != NULL);
+	if (!sort_build(index, view)) {
+		sort_close(index);
+		return NULL;
+	}
+	return index;
+}
+
+struct sort_index *sort_transactions(struct capture *cap, struct filter_view *view, enum sort_key key)
+{
+	return sort_create(cap, false, view, key);
+}
+
+struct sort_index *sort_transfers(struct capture *cap, enum sort_key key)
+{
+	return sort_create(cap, true, NULL, key);
+}
+
+bool sort_extend(struct sort_index *index)
+{
+	struct capture *cap = index->cap;
+
+	if (index->selected)
+		return false;
+
+	// Sort afresh if the capture was rebuilt from a rolling window, or
+	// leave the index empty until it can be.
+	if (cap->window_generation != index->generation) {
+		if (!sort_build(index, NULL)) {
+			index->count = 0;
+			index->num_items = 0;
+			index->num_pending = 0;
+		}
+		return true;
+	}
+
+	// Nothing moves unless items were added, or the key of one pending
+	// has changed.
+	uint64_t num_items = sort_num_items(index);
+	bool changed = (num_items != index->num_items);
+	for (uint64_t i = 0; i < index->num_pending && !changed; i++)
+		changed = (sort_key_value(index, index->pending[i].id) != index->pending[i].key);
+	if (!changed)
+		return false;
+
+	// Sort the items added, along with those pending, in order of ID.
+	uint64_t num_new = index->num_pending + num_items - index->num_items;
+	uint64_t count = index->count - index->num_pending + num_new;
+	struct sort_entry *entries = malloc(num_new * sizeof(struct sort_entry));
+	if (!entries || !sort_reserve(index, count)) {
+		free(entries);
+		return false;
+	}
+	for (uint64_t i = 0; i < index->num_pending; i++)
+		entries[i].id = index->pending[i].id;
+	for (uint64_t i = index->num_pending; i < num_new; i++)
+		entries[i].id = index->num_items + i - index->num_pending;
+	if (!sort_entries(index, entries, num_new)) {
+		free(entries);
+		return false;
+	}
+
+	// Take the pending items out of their old places, moving only the
+	// items sorted after the first of them.
+	uint64_t first = index->count;
+	for (uint64_t i = 0; i < index->num_pending; i++) {
+		uint64_t position = sort_position(index, &index->pending[i]);
+		if (position < first)
+			first = position;
+	}
+	uint64_t n = first;
+	for (uint64_t i = first; i < index->count; i++)
+		if (!sort_pending(index, index->entries[i].id))
+			index->entries[n++] = index->entries[i];
+
+	// Merge in the new entries from the end, moving only the items
+	// sorted after the first of them.
+	uint64_t i = n, j = num_new, end = n + num_new;
+	while (j > 0) {
+		if (i > 0 && sort_before(&entries[j - 1], &index->entries[i - 1]))
+			index->entries[--end] = index->entries[--i];
+		else
+			index->entries[--end] = entries[--j];
+	}
+	free(entries);
+
+	index->count = n + num_new;
+	index->num_items = num_items;
+	sort_pending_find(index);
+	return true;
+}
+
+uint64_t sort_count(struct sort_index *index)
+{
+	return index->count;
+}
+
+uint64_t sort_select(struct sort_index *index, uint64_t n)
+{
+	if (n >= index->count)
+		return index->num_items;
+	return index->entries[n].id;
+}
+
+void sort_close(struct sort_index *index)
+{
+	free(index->entries);
+	free(index->pending);
+	free(index);
+}
+
+// State of an export of packets to a file.
+struct export {
+	// Capture being exported, and file written to.
+	struct capture *cap;
+	FILE *file;
+	// Whether the file is pcapng rather than pcap.
+	bool pcapng;
+	// PIDs of packets exported, as for a filter.
+	uint16_t pids;
+	// Range of times of packets exported.
+	uint64_t start_ns, end_ns;
+	// Next run of polls which may be reached.
+	uint64_t run_id;
+	// Number of packets written.
+	int64_t count;
+	// Buffers for the bytes of a packet, and for its record.
+	uint8_t packet[MAX_PACKET_SIZE];
+	uint8_t record[PCAP_RECORD_OVERHEAD + MAX_PACKET_SIZE];
+};
+
+// Write a packet to an export if its PID and time are selected.
+static inline void export_packet(struct export *ex, struct packet *pkt)
+{
+	if ((ex->pids && !(ex->pids & (1 << (pkt->pid & PID_MASK))))
+			|| pkt->timestamp_ns < ex->start_ns || pkt->timestamp_ns >= ex->end_ns)
+		return;
+
+	// Rebuild the bytes of the packet.
+	uint8_t *buf = ex->packet;
+	if (packet_has_data(pkt->pid, pkt->length)) {
+		buf[0] = pkt->pid;
+		capture_data(ex->cap, pkt->data_offset, pkt->length - 3, &buf[1]);
+		memcpy(&buf[pkt->length - 2], &pkt->fields.data.crc, 2);
+	} else {
+		size_t stored = sizeof(pkt->pid) + sizeof(pkt->fields);
+		memcpy(buf, &pkt->pid, pkt->length < stored ? pkt->length : stored);
+		if (pkt->length > stored)
+			capture_data(ex->cap, pkt->data_offset, pkt->length - stored, &buf[stored]);
+	}
+
+	size_t size = pcap_record(ex->record, ex->pcapng, buf, pkt->length, pkt->timestamp_ns);
+	fwrite(ex->record, 1, size, ex->file);
+	ex->count++;
+}
+
+// Write out the repeats of any run of polls whose stored poll ends with
+// the given packet, having skipped runs before it.
+static inline void export_runs(struct export *ex, uint64_t packet_id)
+{
+	struct capture *cap = ex->cap;
+
+	while (ex->run_id < cap->num_poll_runs
+			&& cap->poll_runs[ex->run_id].packet_id + 1 < packet_id)
+		ex->run_id++;
+	if (ex->run_id == cap->num_poll_runs
+			|| cap->poll_runs[ex->run_id].packet_id + 1 != packet_id)
+		return;
+
+	struct poll_run *run = &cap->poll_runs[ex->run_id];
+	struct packet token, handshake;
+	if (run->first_timestamp_ns < ex->end_ns && run->last_timestamp_ns >= ex->start_ns) {
+		for (uint64_t n = 0; n < run->count; n++) {
+			capture_run_poll(cap, ex->run_id, n, &token, &handshake);
+			export_packet(ex, &token);
+			export_packet(ex, &handshake);
+		}
+	}
+	ex->run_id++;
+}
+
+// Write out a packet of a capture, followed by any repeats of a poll
+// that it ends.
+static inline void export_packet_id(struct export *ex, uint64_t id)
+{
+	struct packet pkt;
+	capture_packet(ex->cap, id, &pkt);
+	export_packet(ex, &pkt);
+	if (ex->cap->num_poll_runs > 0)
+		export_runs(ex, id);
+}
+
+int64_t capture_export(struct capture *cap, const char *filename,
+	struct filter *filter, uint64_t start_ns, uint64_t end_ns, enum export_format format)
+{
+	struct export *ex = malloc(sizeof(struct export));
+	if (!ex)
+		return -1;
+	*ex = (struct export) {
+		.cap = cap,
+		.pcapng = (format == EXPORT_PCAPNG),
+		.pids = filter->pids,
+		.start_ns = start_ns,
+		.end_ns = end_ns,
+	};
+
+	ex->file = fopen(filename, "w");
+	if (!ex->file) {
+		free(ex);
+		return -1;
+	}
+	setvbuf(ex->file, NULL, _IOFBF, EXPORT_BUFFER_SIZE);
+
+	size_t size = pcap_file_header(ex->record, ex->pcapng);
+	fwrite(ex->record, 1, size, ex->file);
+
+	// Start from the first packet in the time range, or from an earlier
+	// poll whose repeats reach into it.
+	uint64_t start_packet = capture_packet_at(cap, start_ns);
+	uint64_t lo = 0, hi = cap->num_poll_runs;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (cap->poll_runs[mid].last_timestamp_ns < start_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < cap->num_poll_runs && cap->poll_runs[lo].packet_id < start_packet)
+		start_packet = cap->poll_runs[lo].packet_id;
+	ex->run_id = lo;
+
+	if (!(filter->addresses[0] | filter->addresses[1] | filter->endpoints | filter->results)) {
+		// Select packets on PID alone, skipping blocks whose summaries
+		// include none of the PIDs.
+		uint64_t end = capture_packet_at(cap, end_ns);
+		for (uint64_t id = start_packet; id < end; id++) {
+			uint64_t block = id / SUMMARY_BLOCK;
+			if (ex->pids && block < cap->num_packet_summaries
+					&& !(ex->pids & cap->packet_summaries[block])) {
+				id = (block + 1) * SUMMARY_BLOCK - 1;
+				continue;
+			}
+			export_packet_id(ex, id);
+		}
+	} else {
+		// Select the packets of transactions matching on everything but
+		// PID, skipping blocks whose summaries do not overlap the filter.
+		struct filter transaction_filter = *filter;
+		transaction_filter.pids = 0;
+		uint64_t start = capture_transaction_at(cap, start_ns);
+		uint64_t first = capture_packet_transaction(cap, start_packet);
+		if (first < start)
+			start = first;
+		uint64_t end = capture_transaction_at(cap, end_ns);
+		for (uint64_t id = start; id < end; id++) {
+			uint64_t block = id / SUMMARY_BLOCK;
+			if (block < cap->num_transaction_summaries
+					&& !filter_overlaps(&transaction_filter, &cap->transaction_summaries[block])) {
+				id = (block + 1) * SUMMARY_BLOCK - 1;
+				continue;
+			}
+			if (!filter_transaction(cap, &transaction_filter, id))
+				continue;
+			struct transaction *tran = &cap->transactions[id];
+			uint64_t packet_end = tran->first_packet_id + tran->num_packets;
+			for (uint64_t packet_id = tran->first_packet_id; packet_id < packet_end; packet_id++)
+				export_packet_id(ex, packet_id);
+		}
+	}
+
+	// Any failed write leaves the stream in error, whether or not closing
+	// it fails too.
+	int64_t count = ex->count;
+	if (ferror(ex->file))
+		count = -1;
+	if (fclose(ex->file) != 0)
+		count = -1;
+	free(ex);
+	return count;
+}
+
+// Names of PIDs, indexed by their low four bits.
+static const char *pid_names[16] = {
+	"RSVD", "OUT", "ACK", "DATA0",
+	"PING", "SOF", "NYET", "DATA2",
+	"SPLIT", "IN", "NAK", "DATA1",
+	"ERR", "SETUP", "STALL", "MDATA",
+};
+
+// Text being formatted into a caller's buffer.
+struct text {
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+// Append a formatted cell to text, followed by a separator. The caller
+// ensures there is room for it.
+static inline void text_cell(struct text *text, char separator, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	text->used += vsnprintf(&text->buf[text->used], FORMAT_CELL_MAX, format, args);
+	va_end(args);
+	text->buf[text->used++] = separator;
+}
+
+// Append payload data to text as hex bytes separated by spaces, followed
+// by a separator.
+static inline void text_data(struct text *text, char separator,
+	struct capture *cap, uint64_t offset, uint16_t length)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	uint8_t data[FORMAT_DATA_MAX];
+
+	if (length > FORMAT_DATA_MAX)
+		length = FORMAT_DATA_MAX;
+	capture_data(cap, offset, length, data);
+
+	char *dest = &text->buf[text->used];
+	for (int i = 0; i < length; i++) {
+		*dest++ = digits[data[i] >> 4];
+		*dest++ = digits[data[i] & 0xF];
+		*dest++ = ' ';
+	}
+	if (length > 0)
+		dest--;
+	*dest++ = separator;
+	text->used = dest - text->buf;
+}
+
+// Append a timestamp to text, relative to the start of the capture.
+static inline void text_timestamp(struct text *text, struct capture *cap, uint64_t timestamp_ns)
+{
+	uint64_t offset_ns = timestamp_ns - cap->packet_checkpoints[0].timestamp_ns;
+	text_cell(text, '\t', "%lu.%09lu", offset_ns / 1000000000, offset_ns % 1000000000);
+}
+
+// Append the address and endpoint of a token to text, or empty cells if
+// the packet is not a token.
+static inline void text_token(struct text *text, struct packet *pkt)
+{
+	if (pkt->pid == SETUP || pkt->pid == IN || pkt->pid == OUT) {
+		text_cell(text, '\t', "%u", pkt->fields.token.address);
+		text_cell(text, '\t', "%u", pkt->fields.token.endpoint_num);
+	} else {
+		text_cell(text, '\t', "");
+		text_cell(text, '\t', "");
+	}
+}
+
+uint64_t capture_format_packets(struct capture *cap, struct filter_view *view,
+	uint64_t first_row, uint64_t num_rows, char *buf, size_t size)
+{
+	struct text text = { buf, size, 0 };
+	uint64_t row;
+
+	for (row = 0; row < num_rows; row++) {
+		// Stop unless the longest possible row fits, with the final NUL.
+		if (text.used + 7 * FORMAT_CELL_MAX + 3 * FORMAT_DATA_MAX + 1 > text.size)
+			break;
+
+		uint64_t id = view ? view_select(view, first_row + row) : first_row + row;
+		uint64_t num_items = view ? view->num_items : cap->num_packets;
+		if (id >= num_items)
+			break;
+
+		struct packet pkt;
+		capture_packet(cap, id, &pkt);
+
+		text_cell(&text, '\t', "%lu", id);
+		text_timestamp(&text, cap, pkt.timestamp_ns);
+		text_token(&text, &pkt);
+		text_cell(&text, '\t', pkt.crc_error ? "%s (CRC error)" : "%s",
+			pid_names[pkt.pid & PID_MASK]);
+		text_cell(&text, '\t', "%u", pkt.length);
+		if ((pkt.pid & PID_TYPE_MASK) == DATA)
+			text_data(&text, '\n', cap, pkt.data_offset, pkt.length > 3 ? pkt.length - 3 : 0);
+		else
+			text_cell(&text, '\n', "");
+	}
+
+	text.buf[text.used] = '\0';
+	return row;
+}
+
+uint64_t capture_format_transactions(struct capture *cap, struct filter_view *view,
+	struct sort_index *order, uint64_t first_row, uint64_t num_rows, char *buf, size_t size)
+{
+	struct text text = { buf, size, 0 };
+	uint64_t row;
+
+	for (row = 0; row < num_rows; row++) {
+		// Stop unless the longest possible row fits, with the final NUL.
+		if (text.used + 11 * FORMAT_CELL_MAX + 3 * FORMAT_DATA_MAX + 1 > text.size)
+			break;
+
+		uint64_t n = first_row + row;
+		uint64_t id = order ? sort_select(order, n) : view ? view_select(view, n) : n;
+		uint64_t num_items = order ? order->num_items : view ? view->num_items : cap->num_transactions;
+		if (id >= num_items)
+			break;
+
+		struct transaction *tran = &cap->transactions[id];
+		struct transaction_info *info = &cap->transaction_info[id];
+
+		text_cell(&text, '\t', "%lu", id);
+		text_timestamp(&text, cap, info->timestamp_ns);
+		text_cell(&text, '\t', "%lu", info->duration_ns);
+		text_cell(&text, '\t', "%s", pid_names[info->type & PID_MASK]);
+		if (info->type == SETUP || info->type == IN || info->type == OUT) {
+			text_cell(&text, '\t', "%u", info->address);
+			text_cell(&text, '\t', "%u", info->endpoint_num);
+		} else {
+			text_cell(&text, '\t', "");
+			text_cell(&text, '\t', "");
+		}
+		text_cell(&text, '\t', "%lu", tran->first_packet_id);
+		text_cell(&text, '\t', "%u", tran->num_packets);
+
+		// Polls repeated in a run are shown on the one stored.
+		uint64_t run_id = cap->num_poll_runs ?
+			capture_packet_run(cap, tran->first_packet_id) : 0;
+		if (!tran->complete)
+			text_cell(&text, '\t', "ERR");
+		else if (run_id < cap->num_poll_runs)
+			text_cell(&text, '\t', "%s (x%lu)", pid_names[info->result & PID_MASK],
+				cap->poll_runs[run_id].count + 1);
+		else
+			text_cell(&text, '\t', "%s", pid_names[info->result & PID_MASK]);
+
+		// Only the payload itself needs the data packet to be read.
+		if (info->data_pid) {
+			struct packet data;
+			capture_packet(cap, tran->first_packet_id + 1, &data);
+			text_cell(&text, '\t', "%u", info->data_length);
+			text_data(&text, '\n', cap, data.data_offset, info->data_length);
+		} else {
+			text_cell(&text, '\t', "");
+			text_cell(&text, '\n', "");
+		}
+	}
+
+	text.buf[text.used] = '\0';
+	return row;
+}
+
+struct capture* open_capture(const char *filename)
+{
+	struct capture *cap = load_capture(filename);
+	return cap ? cap : convert_capture(filename);
+}
+
+void close_capture(struct capture *cap)
+{
+	capture_unmap(cap);
 	free(cap);
 }
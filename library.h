@@ -36,7 +36,8 @@ enum pid {
 struct packet {
 	// Timestamp in ns since Unix epoch
 	uint64_t timestamp_ns;
-	// Offset where this packet's data payload can be found in the data array.
+	// Offset where this packet's data payload can be found in the data
+	// array. For other packets, any bytes beyond the first three are there.
 	uint64_t data_offset;
 	// Length of this packet on the wire.
 	uint16_t length;
@@ -57,6 +58,55 @@ struct packet {
 			uint16_t crc;
 		} data;
 	} fields;
+	// Whether the packet failed its CRC check, or was too short to hold its CRC.
+	bool crc_error;
+};
+
+// Point from which packets are stored relative to each other.
+//
+// Packets are stored in groups, each beginning with a checkpoint. Each
+// group holds packets with consecutive IDs, and at most a few hundred.
+struct packet_checkpoint {
+	// ID of the first packet in the group.
+	uint64_t first_packet_id;
+	// Timestamp of the first packet in the group, in ns since Unix epoch.
+	uint64_t timestamp_ns;
+	// Offset in the data array of the first payload in the group.
+	uint64_t data_offset;
+};
+
+// Location of a block of payload data in a capture with compressed payloads.
+//
+// Payload data is compressed in blocks of 64 KiB, apart from the last
+// block, which may be shorter. Identical blocks may share stored bytes.
+struct data_block {
+	// Offset of the block's stored bytes in the data array.
+	uint64_t offset;
+	// Number of bytes stored, equal to length if stored uncompressed.
+	uint32_t stored_length;
+	// Number of bytes of payload data in the block.
+	uint32_t length;
+};
+
+// Cache of recently decompressed blocks of payload data.
+struct data_cache;
+
+// Run of repeated polls collapsed into one record.
+//
+// A poll is an IN token followed by a NAK. When runs are collapsed, a
+// poll is stored as usual, and any identical polls directly following it
+// are counted in a run, rather than stored as packets and transactions.
+struct poll_run {
+	// ID of the token packet of the poll which is repeated.
+	uint64_t packet_id;
+	// Number of repeats.
+	uint64_t count;
+	// Timestamps of the tokens of the first and last repeats.
+	uint64_t first_timestamp_ns;
+	uint64_t last_timestamp_ns;
+	// Device address and endpoint number polled.
+	uint8_t address;
+	uint8_t endpoint_num;
 };
 
 // Representation of a USB transaction.
@@ -72,6 +122,26 @@ struct transaction {
 	bool complete;
 };
 
+// Summary of a transaction, stored alongside it so that tables can show,
+// sort and aggregate transactions without reading their packets.
+struct transaction_info {
+	// Timestamp of the first packet, in ns since Unix epoch.
+	uint64_t timestamp_ns;
+	// Time from the first packet to the last, in ns.
+	uint64_t duration_ns;
+	// Length of the payload in the data packet, if any.
+	uint16_t data_length;
+	// PID of the first packet, which gives the transaction's type.
+	uint8_t type;
+	// PID of the last packet, which gives its result.
+	uint8_t result;
+	// PID of the data packet, or zero if there is none.
+	uint8_t data_pid;
+	// Device address and endpoint number, or zero for SOF packets.
+	uint8_t address;
+	uint8_t endpoint_num;
+};
+
 // Representation of a USB endpoint.
 //
 // An endpoint is defined by a device address and an endpoint number.
@@ -95,6 +165,28 @@ struct transfer {
 	bool complete;
 };
 
+// Fields of the request in the SETUP packet beginning a control transfer.
+struct setup_request {
+	uint8_t request_type;
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+};
+
+// Summary of a transfer, stored alongside it.
+struct transfer_info {
+	// Timestamp of the first packet, in ns since Unix epoch.
+	uint64_t timestamp_ns;
+	// Time from the first packet to the last, in ns.
+	uint64_t duration_ns;
+	// Total payload bytes of the transactions acknowledged, excluding
+	// the SETUP packet of a control transfer.
+	uint64_t data_length;
+	// Request of a control transfer, or all zero for other transfers.
+	struct setup_request setup;
+};
+
 // Representation of traffic on a specific USB endpoint.
 struct endpoint_traffic {
 	// Number of transfers on this endpoint.
@@ -103,6 +195,8 @@ struct endpoint_traffic {
 	uint64_t num_transaction_ids;
 	// Array of transfers on this endpoint.
 	struct transfer *transfers;
+	// Summary of each transfer on this endpoint.
+	struct transfer_info *transfer_info;
 	// Array of IDs of transactions on this endpoint.
 	uint64_t *transaction_ids;
 };
@@ -115,6 +209,68 @@ struct transfer_index_entry {
 	uint64_t transfer_id;
 };
 
+// Criteria for filtering packets or transactions.
+//
+// Each field is a bitmask of the values accepted, in which a mask of zero
+// accepts any value. Summaries of blocks of packets and transactions use
+// the same structure, with the values present in the block.
+struct filter {
+	// Device addresses, with bit N set for address N.
+	uint64_t addresses[2];
+	// Endpoint numbers, with bit N set for endpoint N.
+	uint16_t endpoints;
+	// PIDs, with bit N set for PIDs whose low four bits are N. For a
+	// transaction, this is the PID of its first packet.
+	uint16_t pids;
+	// Results of transactions, given by the PID of their last packet,
+	// with bits set as for pids.
+	uint16_t results;
+};
+
+// Packets or transactions selected from a capture by a filter.
+struct filter_view;
+
+// Number of separate handshake conditions in a trigger.
+#define TRIGGER_HANDSHAKES 8
+
+// Conditions on which a decoder in trigger mode keeps packets.
+//
+// Each condition is disabled when zero, and the trigger fires on any
+// packet meeting one of those enabled.
+struct trigger {
+	// Fire on a handshake with a PID in the results of one of these
+	// filters, replying to a token accepted by the addresses and endpoints
+	// of the same filter. The pids are ignored.
+	struct filter handshakes[TRIGGER_HANDSHAKES];
+	// Fire on the data packet following a SETUP token, if its bRequest
+	// is in this set, with bit N set for request N.
+	uint64_t setup_requests[4];
+	// Fire on a packet received more than this long after the previous one.
+	uint64_t gap_ns;
+	// Fire on a packet failing its CRC check.
+	bool crc_error;
+	// Packets received this long before and after each packet firing the
+	// trigger are kept.
+	uint64_t pre_ns;
+	uint64_t post_ns;
+};
+
+// Conditions on which a trigger may fire.
+enum trigger_condition {
+	TRIGGER_HANDSHAKE,
+	TRIGGER_SETUP_REQUEST,
+	TRIGGER_GAP,
+	TRIGGER_CRC_ERROR,
+};
+
+// A packet which fired a trigger.
+struct trigger_hit {
+	// Time at which the packet was received.
+	uint64_t timestamp_ns;
+	// Condition which fired.
+	uint8_t condition;
+};
+
 // Types of events in the top level event array.
 enum event_type {
 	// A stray packet (not part of any transaction).
@@ -145,8 +301,26 @@ struct capture {
 	uint64_t num_transactions;
 	// Number of packets in the capture.
 	uint64_t num_packets;
+	// Number of packet checkpoints in the capture.
+	uint64_t num_checkpoints;
 	// Total size of all packet payload data in the capture.
 	uint64_t data_size;
+	// Size of the data array, equal to data_size unless payloads are compressed.
+	uint64_t data_stored_size;
+	// Number of blocks of compressed payload data, or zero if uncompressed.
+	uint64_t num_data_blocks;
+	// Number of complete blocks of 64 packets and transactions summarised.
+	uint64_t num_packet_summaries;
+	uint64_t num_transaction_summaries;
+	// Number of words in the bitmap of CRC errors.
+	uint64_t num_crc_error_words;
+	// Number of runs of repeated polls.
+	uint64_t num_poll_runs;
+	// Number of packets which fired a trigger.
+	uint64_t num_trigger_hits;
+	// Number of times the capture has been rebuilt from a rolling window,
+	// discarding older traffic. All arrays and indices change when it is.
+	uint64_t window_generation;
 	// Array of top-level events.
 	struct event *events;
 	// Array of endpoints seen in the capture.
@@ -157,14 +331,298 @@ struct capture {
 	struct transfer_index_entry *transfer_index;
 	// Array of transactions in the capture.
 	struct transaction *transactions;
-	// Array of packets in the capture.
-	struct packet *packets;
-	// Array of payload data from packets in the capture.
+	// Summary of each transaction.
+	struct transaction_info *transaction_info;
+	// Index of the top-level event containing each transaction.
+	uint64_t *transaction_events;
+	// Index of the top-level event for each transfer in the transfer index.
+	uint64_t *transfer_events;
+	// Packets in the capture, stored as columns. Use capture_packet()
+	// to retrieve a packet.
+	//
+	// PID of each packet.
+	uint8_t *packet_pids;
+	// Length of each packet.
+	uint16_t *packet_lengths;
+	// PID-specific fields of each packet, as in struct packet.
+	uint16_t *packet_fields;
+	// Timestamp of each packet, relative to its group's checkpoint.
+	uint32_t *packet_time_offsets;
+	// Checkpoint for each group of packets.
+	struct packet_checkpoint *packet_checkpoints;
+	// Array of payload data from packets in the capture, which may be
+	// compressed. Use capture_data() to retrieve payload data.
 	uint8_t *data;
+	// Locations of compressed blocks of payload data in the data array.
+	struct data_block *data_blocks;
+	// Cache of decompressed blocks, allocated on first use.
+	struct data_cache *data_cache;
+	// PIDs present in each block of 64 packets, as in struct filter.
+	uint16_t *packet_summaries;
+	// Values present in each block of 64 transactions.
+	struct filter *transaction_summaries;
+	// Bitmap of packets which failed their CRC check, with packet N at
+	// bit N % 64 of word N / 64. Use capture_packet() to check a packet.
+	uint64_t *packet_crc_errors;
+	// Runs of repeated polls, in order of packet ID.
+	struct poll_run *poll_runs;
+	// Packets which fired a trigger, in the order received.
+	struct trigger_hit *trigger_hits;
+};
+
+// Get a packet from a capture.
+void capture_packet(struct capture *capture, uint64_t id, struct packet *packet);
+
+// Find the first packet at or after a time, in ns since Unix epoch.
+//
+// Returns num_packets if there is no such packet.
+uint64_t capture_packet_at(struct capture *capture, uint64_t timestamp_ns);
+
+// Find the first transaction starting at or after a time, in ns since Unix epoch.
+//
+// Returns num_transactions if there is no such transaction.
+uint64_t capture_transaction_at(struct capture *capture, uint64_t timestamp_ns);
+
+// Find the first event starting at or after a time, in ns since Unix epoch.
+//
+// Returns num_events if there is no such event.
+uint64_t capture_event_at(struct capture *capture, uint64_t timestamp_ns);
+
+// Find the transaction containing a packet.
+//
+// Returns num_transactions if the packet is not part of a transaction.
+uint64_t capture_packet_transaction(struct capture *capture, uint64_t packet_id);
+
+// Find the top-level event containing a packet.
+//
+// Returns num_events if the packet is not part of any event.
+uint64_t capture_packet_event(struct capture *capture, uint64_t packet_id);
+
+// Find the position of a transaction among those of the transfer
+// containing it, or zero if it is not part of a transfer.
+uint64_t capture_transaction_position(struct capture *capture, uint64_t transaction_id);
+
+// Find the run of repeats of the poll whose token is the given packet.
+//
+// Returns num_poll_runs if the poll was not repeated.
+uint64_t capture_packet_run(struct capture *capture, uint64_t packet_id);
+
+// Get the nth repeat in a run of polls, as its token and handshake packets.
+//
+// Only the first and last timestamps of a run are stored, so those of
+// repeats in between are interpolated, and the handshake is given the
+// same timestamp as the token.
+void capture_run_poll(struct capture *capture, uint64_t run_id, uint64_t n,
+	struct packet *token, struct packet *handshake);
+
+// Copy payload data from a capture, decompressing it if necessary.
+//
+// Bytes beyond the end of the payload data are read as zero. Must not be
+// called concurrently for the same capture.
+void capture_data(struct capture *capture, uint64_t offset, uint64_t length, uint8_t *buf);
+
+// Select the packets in a capture which match a filter.
+//
+// Packets outside any transaction only match filters on PID alone. The
+// view covers the packets in the capture at the time it was created.
+//
+// Returns NULL if memory could not be allocated.
+struct filter_view *filter_packets(struct capture *capture, struct filter *filter);
+
+// Select the transactions in a capture which match a filter.
+//
+// Returns NULL if memory could not be allocated.
+struct filter_view *filter_transactions(struct capture *capture, struct filter *filter);
+
+// Number of items selected by a view.
+uint64_t view_count(struct filter_view *view);
+
+// Index in the capture of the nth item selected by a view.
+//
+// Returns the number of items in the capture if n is out of range.
+uint64_t view_select(struct filter_view *view, uint64_t n);
+
+// Number of items selected by a view before the given index in the capture.
+uint64_t view_rank(struct filter_view *view, uint64_t id);
+
+// Free a view.
+void view_close(struct filter_view *view);
+
+// Keys by which transactions and transfers can be sorted.
+enum sort_key {
+	// Time from the first packet to the last.
+	SORT_DURATION,
+	// Payload bytes, of the data packet of a transaction, or in total
+	// for a transfer.
+	SORT_DATA_LENGTH,
+	// Whether a transaction or transfer completed, then for a transaction,
+	// the PID of its last packet.
+	SORT_RESULT,
+	// Device address, then endpoint number.
+	SORT_ENDPOINT,
 };
 
+// Items of a capture in order of a sort key.
+struct sort_index;
+
+// Sort the transactions in a capture by a key, or only those selected by
+// a view if it is not NULL.
+//
+// Items with equal keys stay in capture order. Large captures are sorted
+// on as many threads as there are CPUs.
+//
+// Returns NULL if memory cannot be allocated.
+struct sort_index *sort_transactions(struct capture *capture,
+	struct filter_view *view, enum sort_key key);
+
+// Sort the transfers in a capture, in the order of the transfer index, by a key.
+//
+// Returns NULL if memory cannot be allocated.
+struct sort_index *sort_transfers(struct capture *capture, enum sort_key key);
+
+// Add items added to a capture since its index was sorted or last
+// extended, and move any transfers which were then still in progress.
+//
+// If the capture has been rebuilt from a rolling window since, all its
+// items are sorted afresh. An index of items selected by a view is not
+// extended, as the view covers only the items it was created from. If
+// memory cannot be allocated, the index is left as it was, or left empty
+// if the capture was rebuilt.
+//
+// Returns whether the order changed, by items being added or moved.
+bool sort_extend(struct sort_index *index);
+
+// Number of items in a sort index.
+uint64_t sort_count(struct sort_index *index);
+
+// Index in the capture of the nth item in sorted order.
+//
+// Returns the number of items in the capture if n is out of range.
+uint64_t sort_select(struct sort_index *index, uint64_t n);
+
+// Free a sort index.
+void sort_close(struct sort_index *index);
+
+// Incremental decoder for a stream in raw LUNA capture format.
+struct decoder;
+
 // Open a capture from a file in raw LUNA capture format.
+//
+// Returns NULL if the decoded data could not be stored.
 struct capture* convert_capture(const char *filename);
 
+// Options for a decoder.
+enum decoder_flags {
+	// Decode in a pipeline of threads: framing on the calling thread,
+	// packet parsing and transaction/transfer decoding on two others.
+	DECODER_PIPELINED = 1,
+	// Compress payload data in blocks, storing identical blocks only once.
+	DECODER_COMPRESSED = 2,
+	// Collapse runs of repeated IN polls answered with NAK.
+	DECODER_POLL_RUNS = 4,
+};
+
+// Open a decoder, which decodes into a new capture as data is fed to it.
+//
+// Returns NULL if memory could not be allocated.
+struct decoder* decoder_open(unsigned int flags);
+
+// Keep only a rolling window of the most recent packets in a decoder's
+// capture, limited to at most max_bytes of memory for the packets, and
+// if max_ns is nonzero, to packets received within max_ns of the latest.
+//
+// The capture is rebuilt from the window whenever it has grown to twice
+// its size or time span, so holds between one and two windows of traffic.
+// Must be called before any data is fed to the decoder.
+void decoder_window(struct decoder *decoder, uint64_t max_bytes, uint64_t max_ns);
+
+// Keep only packets received around those firing a trigger, so that the
+// capture holds a short segment of traffic around each hit.
+//
+// Up to max_bytes of the most recent packets are held back, from which
+// those received within pre_ns before a hit are decoded. Segments follow
+// on from each other in the capture, without any separation. Must be
+// called before any data is fed to the decoder, and not combined with
+// a rolling window.
+void decoder_trigger(struct decoder *decoder, const struct trigger *trigger, uint64_t max_bytes);
+
+// Feed raw capture data to the decoder. Packets may be split across calls.
+void decoder_feed(struct decoder *decoder, const uint8_t *data, size_t length);
+
+// Read and decode the data currently available from a file descriptor.
+//
+// Returns the number of bytes read, zero at end of file, or -1 on error.
+ssize_t decoder_read(struct decoder *decoder, int fd);
+
+// Update the decoder's capture with everything decoded so far, and return it.
+//
+// Transfers still in progress are included, marked as incomplete. The capture
+// arrays may move, and are only valid until the next call to decoder_snapshot()
+// or decoder_close(). The decoder and capture must not be used concurrently.
+//
+// Returns NULL if decoded data could not be stored, for instance when memory
+// runs out. The capture must not be used after that, and the decoder can only
+// be closed.
+struct capture* decoder_snapshot(struct decoder *decoder);
+
+// Finish decoding, free the decoder and return the completed capture.
+//
+// Returns NULL if decoded data could not be stored, in which case the capture
+// is freed.
+struct capture* decoder_close(struct decoder *decoder);
+
+// Save a capture to a file in indexed capture format.
+//
+// Returns zero on success, or -1 on error.
+int save_capture(struct capture *capture, const char *filename);
+
+// Open a capture from a file in indexed capture format, mapping its arrays
+// directly from the file. Returns NULL if the file is not in that format,
+// or is truncated or corrupt.
+struct capture* load_capture(const char *filename);
+
+// Format rows of the packet table as text, for display.
+//
+// Rows are the packets selected by a view, or all packets if view is NULL.
+// Each row is written as its cells separated by tabs and ended by a
+// newline. The cells are the packet index, timestamp from the start of the
+// capture, address, endpoint, PID, length, and up to 1024 bytes of payload
+// data in hex, with empty cells where they do not apply.
+//
+// Writes as many whole rows as fit in size bytes, followed by a NUL, and
+// returns the number of rows written.
+uint64_t capture_format_packets(struct capture *capture, struct filter_view *view,
+	uint64_t first_row, uint64_t num_rows, char *buf, size_t size);
+
+// Format rows of the transaction table as text, for display, as for
+// capture_format_packets(). The cells are the transaction index, timestamp,
+// duration in ns, type, address, endpoint, index of the first packet,
+// number of packets, result, number of data bytes, and data in hex.
+//
+// If order is not NULL, rows are the transactions in that order, and view
+// is ignored.
+uint64_t capture_format_transactions(struct capture *capture, struct filter_view *view,
+	struct sort_index *order, uint64_t first_row, uint64_t num_rows, char *buf, size_t size);
+
+// Formats to which packets can be exported.
+enum export_format {
+	// pcap, with nanosecond timestamps.
+	EXPORT_PCAP,
+	// pcapng, with nanosecond timestamps.
+	EXPORT_PCAPNG,
+};
+
+// Export packets received from start_ns up to end_ns, in ns since Unix
+// epoch, and accepted by a filter, to a file for Wireshark.
+//
+// Packets are selected as by filter_packets(), with repeats of polls
+// collapsed into runs written out in full. Returns the number of packets
+// written, or -1 on error.
+int64_t capture_export(struct capture *capture, const char *filename,
+	struct filter *filter, uint64_t start_ns, uint64_t end_ns, enum export_format format);
+
+// Open a capture from a file in either indexed or raw LUNA capture format.
+struct capture* open_capture(const char *filename);
+
 // Close capture and free all resources used.
 void close_capture(struct capture *capture);
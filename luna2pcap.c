@@ -1,47 +1,227 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <pcap/pcap.h>
-#include <sys/time.h>
-#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
 
-#define MAX_PACKET_SIZE 0xFFFF
+#include "stream.h"
+#include "pcap.h"
 
-int main(int argc, char* argv[])
+#define MAX_PACKET_SIZE PCAP_SNAPLEN
+// Number of bytes of input read at a time.
+#define READ_SIZE 0x100000
+// Number of bytes of output buffered before writing.
+#define WRITE_SIZE 0x100000
+// Size of the length prefix before each packet in the stream.
+#define LENGTH_SIZE 2
+
+// Whether to write pcapng rather than pcap.
+static bool pcapng = false;
+// Whether the input is a timestamped stream, once identified.
+static bool timestamped = false;
+// Number of bytes of stream magic still to be checked at the start of input.
+static size_t magic_pending = STREAM_MAGIC_SIZE;
+// Header of the current block, in host byte order.
+static struct block_header block;
+// Offset within the current block of the next byte of data.
+static uint64_t block_offset = 0;
+// Storage for a block header split between reads, and bytes held of it.
+static uint8_t header[sizeof(struct block_header)];
+static size_t header_pending = 0;
+// Storage for a packet split between reads, including its length prefix,
+// the number of bytes held of it, and the time its first byte arrived.
+static uint8_t partial[LENGTH_SIZE + MAX_PACKET_SIZE];
+static size_t partial_pending = 0;
+static uint64_t partial_timestamp_ns;
+// Time at which the current read completed, for raw streams.
+static uint64_t read_timestamp_ns;
+// Buffered output, and number of bytes used.
+static uint8_t output[WRITE_SIZE];
+static size_t output_used = 0;
+
+// Write all buffered output to stdout.
+static void output_flush(void)
 {
-	pcap_t *pcap;
-	pcap_dumper_t *dump;
+	size_t done = 0;
+	while (done < output_used) {
+		ssize_t count = write(STDOUT_FILENO, &output[done], output_used - done);
+		if (count <= 0)
+			exit(-2);
+		done += count;
+	}
+	output_used = 0;
+}
 
-	if (!(pcap = pcap_open_dead(DLT_USB_2_0, MAX_PACKET_SIZE)))
-		exit(-1);
-	
-	if (!(dump = pcap_dump_fopen(pcap, stdout)))
-		exit(-2);
+// Write a record for a packet to the buffered output.
+static void packet_write(const uint8_t *data, uint16_t length, uint64_t timestamp_ns)
+{
+	if (output_used + PCAP_RECORD_OVERHEAD + length > WRITE_SIZE)
+		output_flush();
+	output_used += pcap_record(&output[output_used], pcapng, data, length, timestamp_ns);
+}
+
+// Time at which a byte of stream data was received, given its offset from
+// the start of the data passed to stream_feed().
+static inline uint64_t stream_timestamp(size_t offset)
+{
+	if (timestamped)
+		return block_timestamp(&block, block_offset + offset);
+	else
+		return read_timestamp_ns;
+}
 
-	while (1)
+// Frame packets in raw stream data and write them out, taking complete
+// packets directly from the data. Packets may be split across calls.
+static void stream_feed(const uint8_t *data, size_t length)
+{
+	const uint8_t *start = data;
+
+	// Complete any packet split across the previous call.
+	while (partial_pending > 0)
 	{
-		uint16_t len;
-		struct pcap_pkthdr hdr;
-		uint8_t buf[MAX_PACKET_SIZE];
+		size_t needed = LENGTH_SIZE;
+		if (partial_pending >= LENGTH_SIZE)
+			needed += partial[0] << 8 | partial[1];
 
-		if (fread(&len, 1, sizeof(len), stdin) < sizeof(len))
+		if (partial_pending < needed) {
+			// Take as much as we can of what is still missing.
+			if (length == 0)
+				return;
+			size_t count = needed - partial_pending;
+			if (count > length)
+				count = length;
+			memcpy(&partial[partial_pending], data, count);
+			partial_pending += count;
+			data += count;
+			length -= count;
+		} else {
+			// Packet is complete.
+			packet_write(&partial[LENGTH_SIZE], needed - LENGTH_SIZE, partial_timestamp_ns);
+			partial_pending = 0;
+		}
+	}
+
+	// Write complete packets directly from the input.
+	while (length >= LENGTH_SIZE)
+	{
+		uint16_t packet_length = data[0] << 8 | data[1];
+		if (length < LENGTH_SIZE + packet_length)
 			break;
+		packet_write(&data[LENGTH_SIZE], packet_length, stream_timestamp(data - start));
+		data += LENGTH_SIZE + packet_length;
+		length -= LENGTH_SIZE + packet_length;
+	}
+
+	// Keep any remaining bytes for the next call.
+	if (length > 0) {
+		memcpy(partial, data, length);
+		partial_pending = length;
+		partial_timestamp_ns = stream_timestamp(data - start);
+	}
+}
 
-		len = ntohs(len);
+// Process data read from the input, identifying the stream format from
+// its first bytes and removing the headers of any timestamped blocks.
+static void input_feed(const uint8_t *data, size_t length)
+{
+	// Check whether the stream begins with the magic of a timestamped stream.
+	if (magic_pending > 0) {
+		size_t checked = STREAM_MAGIC_SIZE - magic_pending;
+		size_t count = magic_pending < length ? magic_pending : length;
+		if (memcmp(data, &STREAM_MAGIC[checked], count) != 0) {
+			// Raw stream; pass on any part of the magic matched so far.
+			magic_pending = 0;
+			stream_feed((const uint8_t *) STREAM_MAGIC, checked);
+		} else {
+			magic_pending -= count;
+			data += count;
+			length -= count;
+			timestamped = (magic_pending == 0);
+		}
+	}
 
-		if (fread(buf, 1, len, stdin) < len)
-			break;
+	if (!timestamped) {
+		if (magic_pending == 0)
+			stream_feed(data, length);
+		return;
+	}
+
+	// Split timestamped stream into blocks.
+	while (length > 0)
+	{
+		if (block_offset == block.length) {
+			// Start of a new block; accumulate its header.
+			size_t count = sizeof(header) - header_pending;
+			if (count > length)
+				count = length;
+			memcpy(&header[header_pending], data, count);
+			header_pending += count;
+			data += count;
+			length -= count;
+			if (header_pending < sizeof(header))
+				return;
+			header_pending = 0;
+			memcpy(&block, header, sizeof(header));
+			block_header_swap(&block);
+			block_offset = 0;
+		} else {
+			// Write packets from as much of the block's data as we have.
+			size_t count = block.length - block_offset;
+			if (count > length)
+				count = length;
+			stream_feed(data, count);
+			block_offset += count;
+			data += count;
+			length -= count;
+		}
+	}
+}
 
-		if (gettimeofday(&hdr.ts, NULL) != 0)
-			exit(-3);
+void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-n]\n"
+		"  -n  write pcapng rather than pcap\n"
+		"Reads a raw or timestamped stream from standard input, and writes packets\n"
+		"to standard output with nanosecond timestamps.\n",
+		name);
+	exit(-1);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		switch (opt) {
+			case 'n':
+				pcapng = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	uint8_t *buf = malloc(READ_SIZE);
+	if (!buf)
+		exit(-1);
 
-		hdr.caplen = len;
-		hdr.len = len;
+	output_used = pcap_file_header(output, pcapng);
 
-		pcap_dump((u_char*) dump, &hdr, buf);
+	// Read and convert large blocks of input at a time. Packets in a raw
+	// stream are given the time at which the read returned them.
+	ssize_t count;
+	while ((count = read(STDIN_FILENO, buf, READ_SIZE)) > 0) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		read_timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		input_feed(buf, count);
 	}
 
-	pcap_dump_close(dump);
-	pcap_close(pcap);
+	output_flush();
+	free(buf);
 
-	exit(0);
+	exit(count < 0 ? -3 : 0);
 }
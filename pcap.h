@@ -0,0 +1,162 @@
+// pcap and pcapng output formats, for packets exported to Wireshark.
+//
+// Both are written in host byte order, with timestamps in nanoseconds:
+// pcap files use the nanosecond variant of the magic number, and pcapng
+// files describe a single interface with if_tsresol set to 9. Packets
+// are stored with link type LINKTYPE_USB_2_0, as on the wire without
+// any length prefix.
+
+// Link type for USB 2.0 packets, as listed at tcpdump.org.
+#define LINKTYPE_USB_2_0 288
+// Largest packet which may be stored.
+#define PCAP_SNAPLEN 0xFFFF
+
+// Magic number of a pcap file with nanosecond timestamps.
+#define PCAP_MAGIC_NS 0xA1B23C4D
+// pcapng block types, and options used.
+#define PCAPNG_SECTION_HEADER 0x0A0D0D0A
+#define PCAPNG_INTERFACE_DESCRIPTION 1
+#define PCAPNG_ENHANCED_PACKET 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+
+// Largest size of a file header, and of a record apart from packet data.
+#define PCAP_HEADER_MAX 64
+#define PCAP_RECORD_OVERHEAD 36
+
+// Header at the start of a pcap file.
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+// Header before each packet in a pcap file.
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+// pcapng section header block, with no options.
+struct pcapng_section_header {
+	uint32_t type;
+	uint32_t total_length;
+	uint32_t byte_order_magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int64_t section_length;
+	uint32_t total_length_again;
+} __attribute__((packed));
+
+// pcapng interface description block, with an if_tsresol option giving
+// timestamps in nanoseconds.
+struct pcapng_interface_description {
+	uint32_t type;
+	uint32_t total_length;
+	uint16_t linktype;
+	uint16_t reserved;
+	uint32_t snaplen;
+	uint16_t tsresol_code;
+	uint16_t tsresol_length;
+	uint8_t tsresol;
+	uint8_t tsresol_padding[3];
+	uint16_t end_code;
+	uint16_t end_length;
+	uint32_t total_length_again;
+};
+
+// Start of a pcapng enhanced packet block, before the packet data, which
+// is padded to a multiple of four bytes and followed by the total length.
+struct pcapng_packet_header {
+	uint32_t type;
+	uint32_t total_length;
+	uint32_t interface_id;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+// Write the header of a pcap or pcapng file to a buffer of at least
+// PCAP_HEADER_MAX bytes, returning its size.
+static inline size_t pcap_file_header(uint8_t *dest, bool pcapng)
+{
+	if (pcapng) {
+		struct pcapng_section_header section = {
+			.type = PCAPNG_SECTION_HEADER,
+			.total_length = sizeof(section),
+			.byte_order_magic = PCAPNG_BYTE_ORDER_MAGIC,
+			.version_major = 1,
+			.version_minor = 0,
+			.section_length = -1,
+			.total_length_again = sizeof(section),
+		};
+		struct pcapng_interface_description interface = {
+			.type = PCAPNG_INTERFACE_DESCRIPTION,
+			.total_length = sizeof(interface),
+			.linktype = LINKTYPE_USB_2_0,
+			.snaplen = PCAP_SNAPLEN,
+			.tsresol_code = PCAPNG_OPT_IF_TSRESOL,
+			.tsresol_length = 1,
+			.tsresol = 9,
+			.end_code = PCAPNG_OPT_ENDOFOPT,
+			.total_length_again = sizeof(interface),
+		};
+		memcpy(dest, &section, sizeof(section));
+		memcpy(dest + sizeof(section), &interface, sizeof(interface));
+		return sizeof(section) + sizeof(interface);
+	} else {
+		struct pcap_file_header file = {
+			.magic = PCAP_MAGIC_NS,
+			.version_major = 2,
+			.version_minor = 4,
+			.snaplen = PCAP_SNAPLEN,
+			.linktype = LINKTYPE_USB_2_0,
+		};
+		memcpy(dest, &file, sizeof(file));
+		return sizeof(file);
+	}
+}
+
+// Write the record for a packet to a buffer of at least its length plus
+// PCAP_RECORD_OVERHEAD bytes, returning its size.
+static inline size_t pcap_record(uint8_t *dest, bool pcapng,
+	const uint8_t *data, uint16_t length, uint64_t timestamp_ns)
+{
+	if (pcapng) {
+		uint32_t padded = (length + 3) & ~3;
+		uint32_t total_length = sizeof(struct pcapng_packet_header) + padded + 4;
+		struct pcapng_packet_header record = {
+			.type = PCAPNG_ENHANCED_PACKET,
+			.total_length = total_length,
+			.interface_id = 0,
+			.ts_high = timestamp_ns >> 32,
+			.ts_low = timestamp_ns & 0xFFFFFFFF,
+			.caplen = length,
+			.len = length,
+		};
+		memcpy(dest, &record, sizeof(record));
+		dest += sizeof(record);
+		memcpy(dest, data, length);
+		memset(dest + length, 0, padded - length);
+		memcpy(dest + padded, &total_length, 4);
+		return total_length;
+	} else {
+		struct pcap_record_header record = {
+			.ts_sec = timestamp_ns / 1000000000,
+			.ts_nsec = timestamp_ns % 1000000000,
+			.caplen = length,
+			.len = length,
+		};
+		memcpy(dest, &record, sizeof(record));
+		memcpy(dest + sizeof(record), data, length);
+		return sizeof(record) + length;
+	}
+}
@@ -4,156 +4,230 @@ from interface import *
 # Base class for table models
 class TableModel(QAbstractTableModel):
 
+    # Sort key for each column by which rows can be sorted.
+    sort_keys = {}
+
     def __init__(self, parent, capture):
         super().__init__(parent)
         self.capture = capture
+        self.generation = capture.window_generation
+        self.view = None
+        self.rows = self.count()
+        self.cache = {}
+        self.sort_column = None
+        self.descending = False
+        self.sorts = {}
+        self.sorted = None
+        self.first_ns = None
+
+    # Show only the items selected by a view, or all items if None.
+    def set_filter(self, view):
+        self.beginResetModel()
+        self.view = view
+        self.rows = self.count()
+        self.cache = {}
+        self.sorts = {}
+        self.sorted = self.sort_index()
+        self.endResetModel()
+
+    # Sort rows by a column, or show them in capture order if it has no
+    # sort key.
+    def sort(self, column, order):
+        self.beginResetModel()
+        self.sort_column = column
+        self.descending = (order == Qt.DescendingOrder)
+        self.cache = {}
+        self.sorted = self.sort_index()
+        self.endResetModel()
+
+    # Get the sort index for the sort column, or None if it has no sort key.
+    # Indexes are built on first use, kept for each column, and extended
+    # with any items added to the capture when used again.
+    def sort_index(self):
+        key = self.sort_keys.get(self.sort_column)
+        if key is None:
+            return None
+        if self.sort_column in self.sorts:
+            sort_extend(self.sorts[self.sort_column])
+        else:
+            self.sorts[self.sort_column] = self.make_sort(key)
+        return self.sorts[self.sort_column]
+
+    # Position of the item shown in a row, in ascending order.
+    def position(self, row):
+        if self.descending:
+            return self.rows - 1 - row
+        return row
+
+    # Time of an item, as shown, in seconds from the first packet. That
+    # packet's timestamp is read once, as it only changes when the capture
+    # is rebuilt from a rolling window.
+    def time(self, timestamp_ns):
+        if self.first_ns is None:
+            self.first_ns = get_packet(self.capture, 0).timestamp_ns
+        return "%.9f" % ((timestamp_ns - self.first_ns) / 1e9)
+
+    # Index in the capture of the item shown in a row.
+    def item_id(self, row):
+        row = self.position(row)
+        if self.sorted is not None:
+            return sort_select(self.sorted, row)
+        if self.view is None:
+            return row
+        return view_select(self.view, row)
+
+    def rowCount(self, parent):
+        return self.rows
 
     def columnCount(self, parent):
         return len(self.cols)
 
+    # Notify views of rows added and changed since the last update.
+    def update(self):
+        self.cache = {}
+        if self.capture.window_generation != self.generation:
+            # The capture was rebuilt from a rolling window, so all rows
+            # have changed, and any filter view refers to the old items.
+            self.beginResetModel()
+            self.generation = self.capture.window_generation
+            self.first_ns = None
+            self.view = None
+            self.rows = self.count()
+            self.sorts = {}
+            self.sorted = self.sort_index()
+            self.endResetModel()
+            return
+        count = self.count()
+        if self.sorted is not None:
+            # Items added, or transfers still in progress, may move
+            # anywhere among the rows, but usually nothing has changed.
+            if sort_extend(self.sorted) or count != self.rows:
+                self.beginResetModel()
+                self.rows = count
+                self.endResetModel()
+                return
+        elif self.descending and count > self.rows:
+            # Items added appear at the top, moving every row down.
+            self.beginResetModel()
+            self.rows = count
+            self.endResetModel()
+            return
+        if count > self.rows:
+            self.beginInsertRows(QModelIndex(), self.rows, count - 1)
+            self.rows = count
+            self.endInsertRows()
+        if self.rows > 0:
+            first = self.index(0, 0)
+            last = self.index(self.rows - 1, len(self.cols) - 1)
+            self.dataChanged.emit(first, last)
+
     def headerData(self,section, orientation, role):
         if role == Qt.DisplayRole and orientation == Qt.Horizontal:
             return self.cols[section]
         return None
 
-# Table model for packets
-class PacketTableModel(TableModel):
-
-    cols = ["Packet Index", "Timestamp", "Addr", "EP", "PID", "Length", "Data"]
+# Base class for table models whose rows are formatted in C, a block at a
+# time, by a function like capture_format_packets().
+class FormattedTableModel(TableModel):
 
-    INDEX, TIMESTAMP, ADDR, EP, PID, LENGTH, DATA = range(7)
+    # Number of rows formatted at a time, and of blocks kept.
+    BLOCK_ROWS = 256
+    CACHE_BLOCKS = 16
 
-    def rowCount(self, parent):
-        return self.capture.num_packets
+    def __init__(self, parent, capture):
+        super().__init__(parent, capture)
+        self.buffer = format_buffer()
+
+    # Get the cells of a row, formatting the block of rows containing it
+    # if it is not already cached.
+    def cells(self, row):
+        block = row // self.BLOCK_ROWS
+        if block not in self.cache:
+            if len(self.cache) >= self.CACHE_BLOCKS:
+                self.cache = {}
+            self.cache[block] = format_rows(self.format, self.format_args(),
+                block * self.BLOCK_ROWS, self.BLOCK_ROWS, self.buffer)
+        rows = self.cache[block]
+        offset = row - block * self.BLOCK_ROWS
+        return rows[offset] if offset < len(rows) else None
+
+    # Arguments to the format function before the first row.
+    def format_args(self):
+        return (self.capture, self.view)
 
     def data(self, index, role):
         if not index.isValid() or role != Qt.DisplayRole:
             return None
+        cells = self.cells(self.position(index.row()))
+        return cells[index.column()] if cells else None
 
-        row = index.row()
-        col = index.column()
-
-        if col == self.INDEX:
-            return row
-
-        packet = self.capture.packets[row]
-
-        if col == self.TIMESTAMP:
-            offset_ns = packet.timestamp_ns - self.capture.packets[0].timestamp_ns
-            return "%.9f" % (offset_ns / 1e9)
-
-        if col == self.ADDR:
-            if packet.pid in (SETUP, IN, OUT):
-                return packet.fields.token.address
-            return None
+# Table model for packets
+class PacketTableModel(FormattedTableModel):
 
-        if col == self.EP:
-            if packet.pid in (SETUP, IN, OUT):
-                return packet.fields.token.endpoint_num
-            return None
+    cols = ["Packet Index", "Timestamp", "Addr", "EP", "PID", "Length", "Data"]
 
-        if col == self.PID:
-            return pid_names[packet.pid & PID_MASK]
+    INDEX, TIMESTAMP, ADDR, EP, PID, LENGTH, DATA = range(7)
 
-        if col == self.LENGTH:
-            return packet.length
+    format = staticmethod(capture_format_packets)
 
-        if col == self.DATA:
-            if packet.pid & PID_TYPE_MASK != DATA:
-                return None
-            start = packet.data_offset
-            end = packet.data_offset + packet.length
-            packet_data = self.capture.data[start:end]
-            return str.join(" ", ("%02X" % byte for byte in packet_data))
+    def count(self):
+        if self.view is not None:
+            return view_count(self.view)
+        return self.capture.num_packets
 
 # Table model for transactions
-class TransactionTableModel(TableModel):
+class TransactionTableModel(FormattedTableModel):
 
     cols = ["Transaction Index", "Timestamp", "Duration", "Type", "Addr", "EP", "Packet Idx", "Packets", "Result", "Data Bytes", "Data"]
 
     INDEX, TIMESTAMP, DURATION, TYPE, ADDR, EP, PACKET_IDX, NUM_PACKETS, RESULT, DATA_BYTES, DATA = range(11)
 
-    def rowCount(self, parent):
-        return self.capture.num_transactions
+    format = staticmethod(capture_format_transactions)
 
-    def data(self, index, role):
-        if not index.isValid() or role != Qt.DisplayRole:
-            return None
-
-        row = index.row()
-        col = index.column()
-
-        if col == self.INDEX:
-            return row
-
-        transaction = self.capture.transactions[row]
-        start = transaction.first_packet_id
-        end = start + transaction.num_packets
-        packets = self.capture.packets[start:end]
-        first_packet = packets[0]
-        last_packet = packets[transaction.num_packets - 1]
-
-        if col == self.TIMESTAMP:
-            offset_ns = first_packet.timestamp_ns - self.capture.packets[0].timestamp_ns
-            return "%.9f" % (offset_ns / 1e9)
-
-        if col == self.DURATION:
-            return last_packet.timestamp_ns - first_packet.timestamp_ns
-
-        if col == self.TYPE:
-            return pid_names[first_packet.pid & PID_MASK]
-
-        if col == self.ADDR:
-            if first_packet.pid in (SETUP, IN, OUT):
-                return first_packet.fields.token.address
+    sort_keys = {
+        DURATION: SORT_DURATION,
+        ADDR: SORT_ENDPOINT,
+        EP: SORT_ENDPOINT,
+        RESULT: SORT_RESULT,
+        DATA_BYTES: SORT_DATA_LENGTH,
+    }
 
-        if col == self.EP:
-            if first_packet.pid in (SETUP, IN, OUT):
-                return first_packet.fields.token.endpoint_num
-
-        if col == self.PACKET_IDX:
-            return transaction.first_packet_id
-
-        if col == self.NUM_PACKETS:
-            return transaction.num_packets
-
-        if col == self.RESULT:
-            if not transaction.complete:
-                return "ERR"
-            else:
-                return pid_names[last_packet.pid & PID_MASK]
-
-        data_valid = transaction.num_packets > 1 and packets[1].pid & PID_TYPE_MASK == DATA
-
-        if not data_valid:
-            return
+    def count(self):
+        if self.view is not None:
+            return view_count(self.view)
+        return self.capture.num_transactions
 
-        data_packet = packets[1]
+    def make_sort(self, key):
+        return transaction_order(self.capture, self.view, key)
 
-        if col == self.DATA_BYTES:
-            return data_packet.length - 3
-
-        if col == self.DATA:
-            start = data_packet.data_offset
-            end = start + data_packet.length - 3
-            packet_data = self.capture.data[start:end]
-            return str.join(" ", ("%02X" % byte for byte in packet_data))
+    def format_args(self):
+        return (self.capture, self.view, self.sorted)
 
 # Table model for transfers
 class TransferTableModel(TableModel):
 
-    cols = ["Transfer Index", "Timestamp", "Duration", "Type", "Addr", "EP", "Transactions", "Transaction Indices"]
+    cols = ["Transfer Index", "Timestamp", "Duration", "Type", "Addr", "EP", "Transactions", "Data Bytes", "Transaction Indices"]
 
-    INDEX, TIMESTAMP, DURATION, TYPE, ADDR, EP, TRANSACTIONS, INDICES = range(8)
+    INDEX, TIMESTAMP, DURATION, TYPE, ADDR, EP, TRANSACTIONS, DATA_BYTES, INDICES = range(9)
 
-    def rowCount(self, parent):
+    sort_keys = {
+        DURATION: SORT_DURATION,
+        ADDR: SORT_ENDPOINT,
+        EP: SORT_ENDPOINT,
+        DATA_BYTES: SORT_DATA_LENGTH,
+    }
+
+    def count(self):
         return self.capture.num_transfers
 
+    def make_sort(self, key):
+        return transfer_order(self.capture, key)
+
     def data(self, index, role):
         if not index.isValid() or role != Qt.DisplayRole:
             return None
 
-        row = index.row()
+        row = self.item_id(index.row())
         col = index.column()
 
         if col == self.INDEX:
@@ -163,28 +237,23 @@ class TransferTableModel(TableModel):
         endpoint = self.capture.endpoints[entry.endpoint_id]
         ep_traffic = self.capture.endpoint_traffic[entry.endpoint_id]
         transfer = ep_traffic.transfers[entry.transfer_id]
+        info = ep_traffic.transfer_info[entry.transfer_id]
         first_id = transfer.ep_tran_offset
         last_id = first_id + transfer.num_transactions - 1
-        first_transaction = self.capture.transactions[ep_traffic.transaction_ids[first_id]]
-        last_transaction = self.capture.transactions[ep_traffic.transaction_ids[last_id]]
-        first_packet_id = first_transaction.first_packet_id
-        last_packet_id = last_transaction.first_packet_id + last_transaction.num_packets - 1
-        first_packet = self.capture.packets[first_packet_id]
-        last_packet = self.capture.packets[last_packet_id]
 
         if col == self.TIMESTAMP:
-            offset_ns = first_packet.timestamp_ns - self.capture.packets[0].timestamp_ns
-            return "%.9f" % (offset_ns / 1e9)
+            return self.time(info.timestamp_ns)
 
         if col == self.DURATION:
-            return last_packet.timestamp_ns - first_packet.timestamp_ns
+            return info.duration_ns
 
         if col == self.TYPE:
-            if first_packet.pid == SETUP:
+            first_type = self.capture.transaction_info[ep_traffic.transaction_ids[first_id]].type
+            if first_type == SETUP:
                 return "CONTROL"
-            elif first_packet.pid == IN:
+            elif first_type == IN:
                 return "BULK IN"
-            elif first_packet.pid == OUT:
+            elif first_type == OUT:
                 return "BULK OUT"
 
         if col == self.ADDR:
@@ -196,6 +265,9 @@ class TransferTableModel(TableModel):
         if col == self.TRANSACTIONS:
             return transfer.num_transactions
 
+        if col == self.DATA_BYTES:
+            return info.data_length
+
         if col == self.INDICES:
             start = first_id
             end = min(last_id + 1, start + 100)
@@ -210,7 +282,7 @@ class EventTableModel(TableModel):
 
     event_names = ["PKT", "TRN", "XFR"]
 
-    def rowCount(self, parent):
+    def count(self):
         return self.capture.num_events
 
     def data(self, index, role):
@@ -231,32 +303,31 @@ class EventTableModel(TableModel):
         if col == self.TYPE:
             return self.event_names[event.type]
 
+        # Find the timestamp and PID of the event's first packet.
         if event.type == PACKET:
-            packet = self.capture.packets[event.id]
+            packet = get_packet(self.capture, event.id)
+            timestamp_ns, pid = packet.timestamp_ns, packet.pid
         elif event.type == TRANSACTION:
-            transaction = self.capture.transactions[event.id]
-            packet_id = transaction.first_packet_id
-            packet = self.capture.packets[packet_id]
+            info = self.capture.transaction_info[event.id]
+            timestamp_ns, pid = info.timestamp_ns, info.type
         elif event.type == TRANSFER:
             entry = self.capture.transfer_index[event.id]
             traffic = self.capture.endpoint_traffic[entry.endpoint_id]
             transfer = traffic.transfers[entry.transfer_id]
             transaction_id = traffic.transaction_ids[transfer.ep_tran_offset]
-            transaction = self.capture.transactions[transaction_id]
-            packet_id = transaction.first_packet_id
-            packet = self.capture.packets[packet_id]
+            timestamp_ns = traffic.transfer_info[entry.transfer_id].timestamp_ns
+            pid = self.capture.transaction_info[transaction_id].type
 
         if col == self.TIMESTAMP:
-            offset_ns = packet.timestamp_ns - self.capture.packets[0].timestamp_ns
-            return "%.9f" % (offset_ns / 1e9)
+            return self.time(timestamp_ns)
 
         if col == self.SUBTYPE:
             if event.type in (PACKET, TRANSACTION):
-                return pid_names[packet.pid & PID_MASK]
+                return pid_names[pid & PID_MASK]
             elif event.type == TRANSFER:
-                if packet.pid == SETUP:
+                if pid == SETUP:
                     return "CONTROL"
-                elif packet.pid == IN:
+                elif pid == IN:
                     return "BULK IN"
-                elif packet.pid == OUT:
+                elif pid == OUT:
                     return "BULK OUT"
@@ -1,5 +1,5 @@
 from PySide6.QtCore import Qt, QAbstractItemModel, QModelIndex
-from treeitem import EventTreeItem
+from treeitem import EventTreeItem, tree_path
 from interface import *
 
 # Tree model for events
@@ -9,7 +9,11 @@ class EventTreeModel(QAbstractItemModel):
 
     def __init__(self, parent, capture):
         super().__init__(parent)
+        self.capture = capture
+        self.generation = capture.window_generation
         self.root_item = EventTreeItem.root(capture)
+        self.rows = self.root_item.child_count()
+        self.growing = {}
 
     def item(self, index):
         if not index.isValid():
@@ -20,7 +24,52 @@ class EventTreeModel(QAbstractItemModel):
     def rowCount(self, parent):
         if parent.column() > 0:
             return 0
-        return self.item(parent).child_count()
+        if not parent.isValid():
+            return self.rows
+        item = self.item(parent)
+        if item in self.growing:
+            return self.growing[item]
+        count = item.child_count()
+        if item.may_grow():
+            self.growing[item] = count
+        return count
+
+    # Notify views of top level events added since the last update, and of
+    # children added to items that were still growing.
+    def update(self):
+        if self.capture.window_generation != self.generation:
+            # The capture was rebuilt from a rolling window; start afresh.
+            self.beginResetModel()
+            self.generation = self.capture.window_generation
+            self.root_item = EventTreeItem.root(self.capture)
+            self.rows = self.root_item.child_count()
+            self.growing = {}
+            self.endResetModel()
+            return
+        count = self.root_item.child_count()
+        if count > self.rows:
+            self.beginInsertRows(QModelIndex(), self.rows, count - 1)
+            self.rows = count
+            self.endInsertRows()
+        for item, rows in list(self.growing.items()):
+            count = item.child_count()
+            if count > rows:
+                parent = self.createIndex(item.child_index, 0, item)
+                self.beginInsertRows(parent, rows, count - 1)
+                self.growing[item] = count
+                self.endInsertRows()
+            if not item.may_grow():
+                del self.growing[item]
+
+    # Get the index of the item for a packet, transaction or transfer.
+    def find_index(self, item_type, item_id):
+        path = tree_path(self.root_item.capture, item_type, item_id)
+        if path is None or path[0] >= self.rows:
+            return QModelIndex()
+        item = self.root_item
+        for child_index in path:
+            item = item.child_item(child_index)
+        return self.createIndex(item.child_index, 0, item)
 
     def columnCount(self, parent):
         return len(self.cols)
@@ -1,4 +1,4 @@
-from PySide6.QtCore import Qt, QCoreApplication
+from PySide6.QtCore import Qt, QCoreApplication, QTimer
 from PySide6.QtWidgets import QApplication, QHeaderView, QTableView
 from PySide6.QtUiTools import QUiLoader
 from qt_tablemodels import *
@@ -6,20 +6,34 @@ from qt_treemodel import *
 from interface import *
 import faulthandler
 import sys
+import os
 
 faulthandler.enable()
 
-if len(sys.argv) != 2:
-    print("Usage: %s <capture file>" % sys.argv[0])
+if len(sys.argv) not in (2, 3):
+    print("Usage: %s <capture file | - [window MiB]>" % sys.argv[0])
     sys.exit(-1)
 
-# Load capture
-capture = convert_capture(sys.argv[1].encode('ascii'))
+# Load capture, or start decoding one live from standard input,
+# optionally keeping only a rolling window of recent traffic.
+if sys.argv[1] == '-':
+    decoder = decoder_open(DECODER_PIPELINED)
+    if not decoder:
+        print("Could not open decoder", file=sys.stderr)
+        sys.exit(-1)
+    if len(sys.argv) == 3:
+        decoder_window(decoder, int(sys.argv[2]) << 20, 0)
+    capture = decoder_snapshot(decoder)
+    os.set_blocking(sys.stdin.fileno(), False)
+else:
+    decoder = None
+    capture = open_capture(sys.argv[1].encode('ascii'))
 
 # Set up and run UI
 QCoreApplication.setAttribute(Qt.AA_ShareOpenGLContexts)
 app = QApplication.instance() or QApplication([])
 ui = QUiLoader().load('analyzer.ui')
+models = []
 for modelClass, view in (
         (PacketTableModel, ui.packetView),
         (TransactionTableModel, ui.transactionView),
@@ -27,12 +41,62 @@ for modelClass, view in (
         (EventTableModel, ui.eventView),
         (EventTreeModel, ui.eventTreeView)):
     model = modelClass(app, capture)
+    models.append(model)
     view.setModel(model)
     if isinstance(view, QTableView):
         header = view.horizontalHeader()
         header.setVisible(True)
         header.setSectionResizeMode(QHeaderView.ResizeToContents)
         header.setStretchLastSection(True)
+        if model.sort_keys:
+            # Start in capture order; clicking a header sorts by it.
+            header.setSortIndicator(-1, Qt.AscendingOrder)
+            view.setSortingEnabled(True)
     view.show()
+
+# Show the item for a row selected in a table in the event tree.
+tree_model = models[-1]
+def show_in_tree(item_type, index):
+    item_id = index.model().item_id(index.row())
+    tree_index = tree_model.find_index(item_type, item_id)
+    if tree_index.isValid():
+        ui.eventTreeView.setCurrentIndex(tree_index)
+        ui.eventTreeView.scrollTo(tree_index)
+
+for view, item_type in (
+        (ui.packetView, PACKET),
+        (ui.transactionView, TRANSACTION),
+        (ui.transferView, TRANSFER)):
+    view.clicked.connect(
+        lambda index, item_type=item_type: show_in_tree(item_type, index))
+
+# Decode whatever has arrived on standard input, and update views.
+def poll():
+    global decoder
+    for i in range(64):
+        result = decoder_read(decoder, sys.stdin.fileno())
+        if result <= 0:
+            break
+    if result == 0:
+        # End of stream; complete the capture.
+        stored = decoder_close(decoder)
+        decoder = None
+        timer.stop()
+    else:
+        stored = decoder_snapshot(decoder)
+    if not stored:
+        # The capture is incomplete, and no longer usable.
+        print("Decoded data could not be stored", file=sys.stderr)
+        timer.stop()
+        app.exit(-1)
+        return
+    for model in models:
+        model.update()
+
+if decoder is not None:
+    timer = QTimer()
+    timer.timeout.connect(poll)
+    timer.start(100)
+
 ui.show()
 app.exec()
@@ -0,0 +1,47 @@
+// Timestamped capture stream format.
+//
+// A raw LUNA capture stream is a sequence of packets, each preceded by
+// its length as a 16-bit big-endian value.
+//
+// A timestamped stream begins with STREAM_MAGIC, and is followed by blocks
+// of raw stream data, each preceded by a block header. Each block holds the
+// data received in one USB transfer from the analyzer, and its header gives
+// the time range over which that data was received. Packets may be split
+// across blocks.
+//
+// STREAM_MAGIC begins with a length prefix of 0xFFFF, which is far longer
+// than any USB packet, so the two formats cannot be confused.
+
+#define STREAM_MAGIC "\xFF\xFFLUNATS"
+#define STREAM_MAGIC_SIZE 8
+
+// Header preceding each block of data in a timestamped stream.
+//
+// All fields are big-endian, as for packet lengths.
+struct block_header {
+	// Time after which the block's data was received, in ns since Unix epoch.
+	uint64_t start_ns;
+	// Time by which the block's data was received, in ns since Unix epoch.
+	uint64_t end_ns;
+	// Number of bytes of data in the block.
+	uint32_t length;
+} __attribute__((packed));
+
+// Convert a block header between host and stream byte order.
+static inline void block_header_swap(struct block_header *header)
+{
+	header->start_ns = be64toh(header->start_ns);
+	header->end_ns = be64toh(header->end_ns);
+	header->length = be32toh(header->length);
+}
+
+// Estimate the time at which a byte in a block was received, given its
+// offset within the block, assuming data arrived at a steady rate.
+static inline uint64_t block_timestamp(const struct block_header *header, uint64_t offset)
+{
+	if (header->length == 0)
+		return header->end_ns;
+	uint64_t duration = header->end_ns - header->start_ns;
+	return header->start_ns +
+		(unsigned __int128) duration * offset / header->length;
+}
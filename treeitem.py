@@ -42,6 +42,16 @@ class EventTreeItem(object):
         elif self.item_type == PACKET:
             return 0
 
+    # Whether children may still be added to this item, as they are to the
+    # last transfer on an endpoint while it is in progress.
+    def may_grow(self):
+        if self.item_type != TRANSFER:
+            return False
+        entry = self.capture.transfer_index[self.item_id]
+        traffic = self.capture.endpoint_traffic[entry.endpoint_id]
+        transfer = traffic.transfers[entry.transfer_id]
+        return not transfer.complete and entry.transfer_id == traffic.num_transfers - 1
+
     # Construct a child of this item.
     def child_item(self, child_index):
         if child := self.child_cache.get(child_index):
@@ -74,23 +84,43 @@ class EventTreeItem(object):
             traffic = self.capture.endpoint_traffic[entry.endpoint_id]
             transfer = traffic.transfers[entry.transfer_id]
             first_transaction_id = traffic.transaction_ids[transfer.ep_tran_offset]
-            first_transaction = self.capture.transactions[first_transaction_id]
-            first_packet = self.capture.packets[first_transaction.first_packet_id]
-            if first_packet.pid == SETUP:
+            first_type = self.capture.transaction_info[first_transaction_id].type
+            if first_type == SETUP:
                 fmt = "Control transfer on %u.%u with %u transactions"
-            elif first_packet.pid == IN:
+            elif first_type == IN:
                 fmt = "Bulk transfer from %u.%u to host with %u transactions"
-            elif first_packet.pid == OUT:
+            elif first_type == OUT:
                 fmt = "Bulk transfer from host to %u.%u with %u trasactions"
             return fmt % (ep.address, ep.endpoint_num, transfer.num_transactions)
         elif self.item_type == TRANSACTION:
             transaction = self.capture.transactions[self.item_id]
-            first_packet = self.capture.packets[transaction.first_packet_id]
-            if first_packet.pid == SOF:
+            first_type = self.capture.transaction_info[self.item_id].type
+            if first_type == SOF:
                 return "Idle period with %u SOF packets" % transaction.num_packets
-            name = pid_names[first_packet.pid & PID_MASK]
+            name = pid_names[first_type & PID_MASK]
             return "%s transaction, %u packets" % (name, transaction.num_packets)
         elif self.item_type == PACKET:
-            packet = self.capture.packets[self.item_id]
+            packet = get_packet(self.capture, self.item_id)
             name = pid_names[packet.pid & PID_MASK]
             return "%s packet, %u bytes" % (name, packet.length)
+
+# Find the path to the tree item for a packet, transaction or transfer,
+# as a list of child indices from the root, or None if it has no item.
+def tree_path(capture, item_type, item_id):
+    if item_type == PACKET:
+        transaction_id = capture_packet_transaction(capture, item_id)
+        if transaction_id == capture.num_transactions:
+            event_id = capture_packet_event(capture, item_id)
+            if event_id == capture.num_events:
+                return None
+            return [event_id]
+        transaction = capture.transactions[transaction_id]
+        path = tree_path(capture, TRANSACTION, transaction_id)
+        return path + [item_id - transaction.first_packet_id]
+    elif item_type == TRANSACTION:
+        event_id = capture.transaction_events[item_id]
+        if capture.events[event_id].type == TRANSFER:
+            return [event_id, capture_transaction_position(capture, item_id)]
+        return [event_id]
+    elif item_type == TRANSFER:
+        return [capture.transfer_events[item_id]]